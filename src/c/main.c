@@ -1,9 +1,20 @@
 #include <string.h>
+#include <strings.h>    // strcasecmp
 #include <stdio.h>
 #include <math.h>       // M_PI, sqrt, sin, cos
 #include <pthread.h>
-#include <sys/stat.h>   // Acquiring information about .wav files to calculate number of
-                        // FFT processing frames
+#include <unistd.h>     // sysconf, getopt, dup
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE/AVX2 pre-FFT kernels
+#define PREPROCESS_SIMD 1
+#endif
+#ifdef HEADLESS
+#include <time.h>       // clock_gettime for per-file wall time
+#include <limits.h>     // PATH_MAX
+#endif
 
 #include "../include/main.h"
 #include "../include/onsetsds.h"
@@ -12,36 +23,97 @@
 #define REAL 0
 #define IMAG 1
 
-#define SAMPLE_RATE         22050
+#define SAMPLE_RATE         22050   // Rate recordings are captured at, and uploads
+                                    // are brought down to (see getRateFactor())
+#define MIN_SAMPLE_RATE     8000    // Range of upload sample rates supported
+#define MAX_SAMPLE_RATE     192000
 #define CHANNELS            1       // Mono input
 #define MAX_FREQUENCY       1109    // Limit the range to three piano octaves from  
                                     // C3-C6, (but cap at C#6) so a frequency range of 
                                     // 130.8 Hz - 1108.73 Hz
 #define MIN_FREQUENCY       130
-#define BIN_SIZE            ((float)SAMPLE_RATE / (float)WINDOW_SIZE)
+#define NUM_BINS(fftSize)   ((fftSize) / 2 + 1)     // Bins in the real FFT's half spectrum
 
 #define NOISE_FLOOR         0.05f   // Ensure the amplitude is at least this value
                                     // to help cancel out quieter noise
                                     
-#define MAX_NOTES           1000    // Maximum size of the buffer to contain note data
-                                    // for writing to the MIDI file to save on memory
-                                    
 #define MEDIAN_SPAN         11      // Amount of previous frames to account for, for
                                     // onset detection.
                                     
-#define NUM_HARMONICS       5       // Number of harmonics for the harmonic product spectrum
-                                    // to consider
+#define NUM_HARMONICS       5       // Default number of harmonics for the harmonic product
+                                    // spectrum to consider
+#define MIN_HARMONICS       2       // Range that can be chosen
+#define MAX_HARMONICS       8
+#define HPS_CHUNK           1024    // Bins handled together by the HPS kernels
                                     
 #define OCTAVE_SIZE         12      // Number of pitches in an octave.
 
+#define NUM_KEYS            88      // Notes that can be named - the piano keys A0-C8
+#define LOWEST_KEY          21      // MIDI note number of A0
+#define TUNING_KEY          69      // MIDI note number of A4, the reference pitch
+#define DEFAULT_TUNING      440.0f  // Frequency of A4 (Hz) unless changed
+#define MIN_TUNING          400.0f  // Range that can be chosen
+#define MAX_TUNING          480.0f
+
+#define MIN_FFT_SIZE        1024    // Range of FFT sizes (frame sizes) that can
+#define MAX_FFT_SIZE        65536   // be chosen - powers of two
+#define NUM_FFT_SIZES       7
+#define PRELOAD_MAX_FFT_SIZE 8192   // Plans up to this size are built at startup,
+                                    // larger ones when first used
+
+#define DEFAULT_FFT_SIZE    2048    // Used unless another size is chosen
+
+#define MAX_BLOCK_SAMPLES   (1 << 20)   // Limit on a block of upload frames, so
+                                        // blocks of large FFTs don't get too big
+
+#define ARENA_ALIGN         64      // Alignment of the analysis buffers (cache line)
+#define ARENA_ROUND(bytes)  (((bytes) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define MIDI_TRACK_MEM      32768   // Bytes of the arena the MIDI track is written into -
+                                    // it's flushed after every note, so rarely needs more
+
+#define WINDOW_HANN         0       // Window functions - see getWindow()
+#define WINDOW_HAMMING      1
+#define WINDOW_BLACKMAN_HARRIS 2
+#define WINDOW_KAISER       3
+#define NUM_WINDOW_TYPES    4
+#define KAISER_BETA         9.0     // Kaiser window shape - sidelobes around -90 dB
+
+#define MAX_DECIMATION      4       // Largest decimation factor that can be chosen
+#define DECIMATION_TAPS     32      // Decimation filter taps per unit of the factor
+#define DECIMATION_CUTOFF   0.875   // Decimation filter cutoff, as a fraction of the
+                                    // decimated Nyquist frequency
+#define DECIMATION_BETA     5.65    // Kaiser shape of the decimation filter - stopband
+                                    // around -60 dB
+#define DECIMATION_CHUNK    1024    // Input samples decimated together
+
+#define SIMD_SCALAR         0       // Pre-FFT kernels - see preprocessFrames()
+#define SIMD_SSE            1
+#define SIMD_AVX2           2
+
+#define FFT_BLOCK_FRAMES    8       // Frames of an upload transformed together by
+                                    // one batched FFT
+
+#define PARALLEL_MIN_SIZE   8192    // FFT size from which the FFT and the per-bin
+                                    // loops are split across the session's threads
+
+#define PARALLEL_BLOCKS     4       // Blocks of FFT_BLOCK_FRAMES per thread in each
+                                    // batch of upload frames analysed in parallel
+
+#define FFT_PLAN_RIGOUR     FFTW_MEASURE    // FFTW_PATIENT can find slightly faster plans,
+                                            // but takes much longer to measure the first time
+#define WISDOM_FILE         ".p-fftw-wisdom" // Saved FFT plan measurements (in $HOME)
+
+#define RING_SECONDS        10      // Amount of recorded audio that can be waiting
+                                    // for analysis at any one time
+
+#define CAPTURE_POLL_MS     5       // How long the analysis waits for more audio
+                                    // to be captured before checking again
+
+#ifndef HEADLESS
 //////////////////////////////////////////////////////////////////////////////
-// Global flags for thread management
-static int      running     = 0;
+// Global flag for thread management - set while the GUI's session is being
+// transcribed
 static int      processing  = 0;
-static int      firstRun    = 0;
-
-static bool newRecording = false;
-static bool isUpload = false;
 
 //////////////////////////////////////////////////////////////////////////////
 // Global GTK widgets/general data for manipulation from different functions
@@ -59,51 +131,57 @@ typedef struct
     GtkWidget*      fileOutput;
     GtkWidget*      fileUpload;
     GtkWidget*      fftSize;
+    GtkWidget*      overlap;
+    GtkWidget*      window;
     GtkWidget*      quantisation;
 } FIELD_DATA;
+#endif
 
-static  int             tempoVal            = 0;
+static  int             simdLevel           = SIMD_SCALAR;  // Pre-FFT kernel in use
+                                                            // (see preprocessInit())
 
-static  tMIDI_KEYSIG    keySigVal           = keyCMaj;
-
-static  int             beatsPerBar         = 0;
-static  int             noteDiv             = 0;
-
-static  float           quantisationFactor  = 1.0f;
-
-static  char            fileOutputLoc[500];
-static  char            wavOutputLoc[500];
-
-static  char            wavUploadLoc[500];
-
-static  int             WINDOW_SIZE         = 2048;
+static  int             planThreads         = 1;    // Threads large single-frame FFT plans are
+                                                    // split across (see createFftPlan())
 
+#ifndef HEADLESS
 //////////////////////////////////////////////////////////////////////////////
-// Processing thread (to not freeze main GUI thread)
+// Processing thread (to not freeze main GUI thread), and the session it runs
 pthread_t       procTask;
+static SESSION  guiSession;
+#endif
 
 //////////////////////////////////////////////////////////////////////////////
 // Mutexes
-pthread_mutex_t runLock;
-pthread_mutex_t procLock;
+pthread_mutex_t procLock    = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t planLock    = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t windowLock  = PTHREAD_MUTEX_INITIALIZER;
+
+//////////////////////////////////////////////////////////////////////////////
+// FFT plans for each supported FFT size (see fftPlansInit()) - single
+// frame, and blocks of FFT_BLOCK_FRAMES frames
+static  fftwf_plan      fftPlans[NUM_FFT_SIZES];
+static  fftwf_plan      fftBlockPlans[NUM_FFT_SIZES];
+static  char            wisdomLoc[500];
+static  bool            wisdomChanged       = false;    // New plans measured since wisdom loaded
 
 //////////////////////////////////////////////////////////////////////////////
-// Buffers to store the output data to be translated into MIDI notes
-char        recPitches[MAX_NOTES][4];
-int         recLengths[MAX_NOTES];
-int         recMidiPitches[MAX_NOTES];
-static int  totalLen = 0;
-static int  bufIndex = 0;
+// Window function tables for each type and FFT size, built when first used
+// (see getWindow())
+static  float*          windowTables[NUM_WINDOW_TYPES][NUM_FFT_SIZES];
+static  const char*     windowNames[NUM_WINDOW_TYPES] = { "hann", "hamming", "blackman-harris", "kaiser" };
 
 //////////////////////////////////////////////////////////////////////////////
-// Establish notes and corresponding
-// frequencies
-char* notes[37] = 
+// Names of the piano keys A0-C8, by MIDI note number from LOWEST_KEY
+#define OCTAVE_NAMES(octave) \
+    "C" #octave, "C#" #octave, "D" #octave, "D#" #octave, "E" #octave, "F" #octave, \
+    "F#" #octave, "G" #octave, "G#" #octave, "A" #octave, "Bb" #octave, "B" #octave
+
+const char* noteNames[NUM_KEYS] = 
 { 
-    "C3", "C#3", "D3", "D#3", "E3", "F3", "F#3", "G3", "G#3", "A3", "Bb3", "B3",
-    "C4", "C#4", "D4", "D#4", "E4", "F4", "F#4", "G4", "G#4", "A4", "Bb4", "B4",
-    "C5", "C#5", "D5", "D#5", "E5", "F5", "F#5", "G5", "G#5", "A5", "Bb5", "B5",
-    "C6"
+    "A0", "Bb0", "B0",
+    OCTAVE_NAMES(1), OCTAVE_NAMES(2), OCTAVE_NAMES(3), OCTAVE_NAMES(4),
+    OCTAVE_NAMES(5), OCTAVE_NAMES(6), OCTAVE_NAMES(7),
+    "C8"
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -142,113 +220,150 @@ const tMIDI_KEYSIG midiKeys[OCTAVE_SIZE]
             keyBMaj,    
         };
 
-//////////////////////////////////////////////////////////////////////////////
-// Will store all of the corresponding MIDI pitch values per note
-int midiNotes[37];
+#ifndef HEADLESS
+// Fills in the settings shared by recordings and uploads from the GUI. Returns
+// false if any are missing
+bool getGuiConfig(FIELD_DATA* d, SESSION_CONFIG* config, char** outputLoc)
+{
+    // Get file output location
+    GtkFileChooser* chooser = GTK_FILE_CHOOSER(d->fileOutput);
+    char* tempLoc = gtk_file_chooser_get_filename(chooser);
+    
+    // Get tempo
+    int tempoVal = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(d->tempo));
+    
+    // Get time signature
+    int beatsPerBar = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(d->time));
+    char* tempTimeSigDenomVal = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->timeDenom));
 
-//////////////////////////////////////////////////////////////////////////////
-// List of corresponding frequencies per pitch C3-C6.
-// Add C#6 purely for upper bound checking in case the note detected is a C6
-float frequencies[38] = 
-{
-    // C    // C#   // D    // D#   // E    // F    // F#   // G    // G#   // A    // Bb   // B
-    130.81,  138.59, 146.83, 155.56, 164.81, 174.61, 185.00, 196.00, 207.65, 220.00, 233.08, 246.94,
-    261.63,  277.18, 293.66, 311.13, 329.63, 349.23, 369.99, 392.00, 415.30, 440.00, 466.16, 493.88,
-    523.25,  554.37, 587.33, 622.25, 659.25, 698.46, 739.99, 783.99, 830.61, 880.00, 932.33, 987.77,
-    1046.50, 1108.73
-};
+    // Get quantisation factor
+    char* tempQuant = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->quantisation));
+    
+    // Get key signature
+    char* tempKeyVal = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->key));
+    
+    char* tempFftSize = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->fftSize));
+    
+    char* tempOverlap = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->overlap));
+    
+    char* tempWindow = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->window));
+    
+    bool valid = tempoVal && beatsPerBar && tempKeyVal != NULL && tempTimeSigDenomVal != NULL && tempLoc != NULL && tempFftSize != NULL && tempOverlap != NULL && tempWindow != NULL && tempQuant != NULL;
+    
+    if (valid)
+    {
+        sessionConfigInit(config);
+        
+        // The GUI's sessions use every core, as its FFT plans do
+        config->numThreads          = planThreads;
+        
+        config->tempo               = tempoVal;
+        config->beatsPerBar         = beatsPerBar;
+        config->fftSize             = atoi(tempFftSize);
+        config->overlapPct          = atof(tempOverlap);
+        config->windowType          = getWindowType(tempWindow);
+        config->quantisationFactor  = getQuantVal(tempQuant);
+        config->keySig              = getMIDIKey(tempKeyVal);
+        config->noteDiv             = getTimeSigDenom(tempTimeSigDenomVal);
+        
+        printf("\n=== Key sig: %s, tempo: %d, FFT size: %d, time sig: %d %s per bar ===\n", tempKeyVal, tempoVal, config->fftSize, beatsPerBar, tempTimeSigDenomVal);
+    }
+    
+    g_free(tempKeyVal);
+    g_free(tempTimeSigDenomVal);
+    g_free(tempFftSize);
+    g_free(tempOverlap);
+    g_free(tempWindow);
+    g_free(tempQuant);
+    
+    (*outputLoc) = tempLoc;
+    
+    return (valid);
+}
+
+// Transcribes the GUI's session on the processing thread
+void* runGuiSession(void* args)
+{
+    record(&guiSession);
+    
+    pthread_mutex_lock(&procLock);
+    processing = 0; // Indicate to main (GTK) thread that processing has now stopped
+    pthread_mutex_unlock(&procLock);
+    
+    return (NULL);
+}
+
+// Starts the processing thread on the GUI's session
+void startGuiSession(void)
+{
+    printf("\n*** Starting recording thread... ***\n");
+    
+    pthread_mutex_lock(&procLock);
+    processing = 1;
+    pthread_mutex_unlock(&procLock);
+
+    int threadResult = pthread_create(&procTask, NULL, runGuiSession, NULL);
+    
+    if (threadResult != 0)
+    {
+        g_error("\nERROR: Failed to start thread\n");
+    }
+    
+    pthread_detach(procTask);
+}
+
+// True while the last session is still being transcribed - the GUI only runs
+// one at a time
+bool isProcessing(FIELD_DATA* d)
+{
+    pthread_mutex_lock(&procLock);
+    bool busy = processing;
+    pthread_mutex_unlock(&procLock);
+    
+    if (busy)
+    {
+        gtk_label_set_text(GTK_LABEL(d->msgLbl), "Please wait for the last transcription to finish");
+    }
+    
+    return (busy);
+}
 
 // Responsible for starting/stopping recording upon clicking the GUI button
 void toggleRecording(GtkWidget* widget, gpointer data)
 {
-    int threadResult = 0;
-    int threadResult2 = 0;
-    
     // Take a copy of the input data fed in for reading here
     FIELD_DATA* d = (FIELD_DATA*)data;    
     
-    if (running)
+    if (atomic_load(&guiSession.running))
     {
-        newRecording = false;
-        
         printf("\n*** Stopping recording thread... ***\n");
         
-        pthread_mutex_lock(&runLock);
-        running = 0;
-        pthread_mutex_unlock(&runLock);
+        atomic_store(&guiSession.running, false);
         
         gtk_button_set_label(GTK_BUTTON(recBtn), "Record");
     }
     
-    else
+    else if (!isProcessing(d))
     {
-        // Get file output location
-        GtkFileChooser* chooser = GTK_FILE_CHOOSER(d->fileOutput);
-        char* tempLoc = gtk_file_chooser_get_filename(chooser);
-        
-        // Get tempo
-        tempoVal = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(d->tempo));
-        
-        // Get time signature
-        beatsPerBar = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(d->time));
-        char* tempTimeSigDenomVal = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->timeDenom));
-
-        // Get quantisation factor
-        char* tempQuant = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->quantisation));
-        
-        // Get key signature
-        char* tempKeyVal = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->key));
+        SESSION_CONFIG config;
+        char* tempLoc = NULL;
         
-        char* tempFftSize = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->fftSize));
-                
         // Only start recording if valid values
-        if (tempoVal && beatsPerBar && tempKeyVal != NULL && tempTimeSigDenomVal != NULL && tempLoc != NULL && tempFftSize != NULL && tempQuant != NULL)
+        if (getGuiConfig(d, &config, &tempLoc))
         {
-            newRecording = true;
-            isUpload = false;
-            
             // Clear warning text - all values needed are present
             gtk_label_set_text(GTK_LABEL(d->msgLbl), "");
             
-            // Set FFT size
-            WINDOW_SIZE = atoi(tempFftSize);
-
-            // Set quantisation factor
-            quantisationFactor = getQuantVal(tempQuant);
+            sessionInit(&guiSession, &config);
+            guiSession.isRecording = true;
             
             // Set destination file locations
-            strcpy(fileOutputLoc, tempLoc);
-            strcpy(wavOutputLoc, tempLoc);
-            strcat(fileOutputLoc, ".mid");
-            strcat(wavOutputLoc, ".wav");
-            
-            keySigVal   = getMIDIKey(tempKeyVal);
-            noteDiv     = getTimeSigDenom(tempTimeSigDenomVal);
-            
-            firstRun = 1;
-        
-            printf("\n=== Key sig: %s, tempo: %d, FFT size: %d ===\n", tempKeyVal, tempoVal, WINDOW_SIZE);
-            g_free(tempKeyVal);
-            g_free(tempTimeSigDenomVal);
-            g_free(tempFftSize);
-            g_free(tempQuant);
-            
-            printf("\n*** Starting recording thread... ***\n");
-            
-            pthread_mutex_lock(&runLock);
-            running = 1;
-            pthread_mutex_unlock(&runLock);
+            strcpy(guiSession.fileOutputLoc, tempLoc);
+            strcpy(guiSession.wavOutputLoc, tempLoc);
+            strcat(guiSession.fileOutputLoc, ".mid");
+            strcat(guiSession.wavOutputLoc, ".wav");
             
-            pthread_mutex_lock(&procLock);
-            processing = 1;
-            pthread_mutex_unlock(&procLock);
-        
-            threadResult2 = pthread_create(&procTask, NULL, record, NULL);
-            
-            if (threadResult2 != 0)
-            {
-                g_error("\nERROR: Failed to start thread\n");
-            }
+            startGuiSession();
             
             gtk_button_set_label(GTK_BUTTON(recBtn), "Stop");
         }
@@ -257,106 +372,62 @@ void toggleRecording(GtkWidget* widget, gpointer data)
             // Else display a message
             gtk_label_set_text(GTK_LABEL(d->msgLbl), "Please correct missing/invalid values");
         }
+        
+        g_free(tempLoc);
     }
 }
 
 // Handles clicking the upload button - parsing a pre-recorded .wav file
 void processUpload(GtkWidget* widget, gpointer data)
 {
-    int threadResult = 0;
-    int threadResult2 = 0;
-    
     // Take a copy of the input data fed in for reading here
     FIELD_DATA* d = (FIELD_DATA*)data;
     
-    // Get .wav file upload location
-    GtkFileChooser* chooser1 = GTK_FILE_CHOOSER(d->fileUpload);
-    char* tempUploadLoc = gtk_file_chooser_get_filename(chooser1);
-        
-    // Get MIDI file output location
-    GtkFileChooser* chooser2 = GTK_FILE_CHOOSER(d->fileOutput);
-    char* tempLoc = gtk_file_chooser_get_filename(chooser2);
+    if (isProcessing(d))
+    {
+        return;
+    }
     
-    // Get FFT size
-    char* tempFftSize = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->fftSize));
-
-    // Get quantisation factor
-    char* tempQuant = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->quantisation));
-       
-    // Get tempo
-    tempoVal = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(d->tempo));
-        
-    // Get time signature
-    beatsPerBar = (int)gtk_spin_button_get_value(GTK_SPIN_BUTTON(d->time));
-
-    char* tempTimeSigDenomVal = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->timeDenom));
+    // Get .wav file upload location
+    GtkFileChooser* chooser = GTK_FILE_CHOOSER(d->fileUpload);
+    char* tempUploadLoc = gtk_file_chooser_get_filename(chooser);
     
-    // Get key signature
-    char* tempKeyVal = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(d->key));
+    SESSION_CONFIG config;
+    char* tempLoc = NULL;
             
     // Only start processing if valid values
     if (tempUploadLoc == NULL || strlen(tempUploadLoc) < 5 || strcmp(".wav", &tempUploadLoc[strlen(tempUploadLoc) - 4]) != 0)
     {
         gtk_label_set_text(GTK_LABEL(d->msgLbl), "Please upload a .wav file.");
     }
-    else if (tempoVal && beatsPerBar && tempKeyVal != NULL && tempTimeSigDenomVal != NULL && tempLoc != NULL && tempUploadLoc != NULL && tempFftSize != NULL && tempQuant != NULL)
+    else if (getGuiConfig(d, &config, &tempLoc))
     {
         gtk_label_set_text(GTK_LABEL(d->msgLbl), "");
         
-        // Set FFT size
-        WINDOW_SIZE = atoi(tempFftSize);
-
-        // Set quantisation factor
-        quantisationFactor = getQuantVal(tempQuant);
-        
         // NOT a recording
-        newRecording = false;
-        isUpload = true;
+        sessionInit(&guiSession, &config);
+        guiSession.isRecording = false;
         
         // Set destination file locations
-        strcpy(fileOutputLoc, tempLoc);
-        strcpy(wavOutputLoc, tempLoc);
-        strcat(fileOutputLoc, ".mid");
-        strcat(wavOutputLoc, ".wav");
-        
-        strcpy(wavUploadLoc, tempUploadLoc);
-        
-        keySigVal   = getMIDIKey(tempKeyVal);
-        noteDiv     = getTimeSigDenom(tempTimeSigDenomVal);
-        
-        firstRun = 1;
-    
-        printf("\n=== Key sig: %s, tempo: %d, FFT size: %d, time sig: %d %s per bar ===\n", tempKeyVal, tempoVal, WINDOW_SIZE, beatsPerBar, tempTimeSigDenomVal);
-        g_free(tempKeyVal);
-        g_free(tempTimeSigDenomVal);
-        g_free(tempLoc);
-        g_free(tempUploadLoc);
-        g_free(tempFftSize);
-        g_free(tempQuant);
-        
-        printf("\n*** Starting recording thread... ***\n");
-        
-        pthread_mutex_lock(&runLock);
-        running = 1;
-        pthread_mutex_unlock(&runLock);
+        strcpy(guiSession.fileOutputLoc, tempLoc);
+        strcpy(guiSession.wavOutputLoc, tempLoc);
+        strcat(guiSession.fileOutputLoc, ".mid");
+        strcat(guiSession.wavOutputLoc, ".wav");
         
-        pthread_mutex_lock(&procLock);
-        processing = 1;
-        pthread_mutex_unlock(&procLock);
-    
-        threadResult2 = pthread_create(&procTask, NULL, record, NULL);
+        strcpy(guiSession.wavUploadLoc, tempUploadLoc);
         
-        if (threadResult2 != 0)
-        {
-            g_error("\nERROR: Failed to start thread\n");
-        }
+        startGuiSession();
     }
     else
     {
         // Else display a message
         gtk_label_set_text(GTK_LABEL(d->msgLbl), "Please correct missing/invalid values");
     }
+    
+    g_free(tempLoc);
+    g_free(tempUploadLoc);
 }
+#endif
 
 // Function to extract the quantisation value
 float getQuantVal(const char* input)
@@ -383,47 +454,103 @@ float getQuantVal(const char* input)
     }
 }
 
-// Functions for appending to output pitch/length buffers
-void pitchesAdd(char* pitch, int length, int midiNote)
-{    
-    strcpy(recPitches[bufIndex], pitch);
-    recLengths[bufIndex] = length;
-    recMidiPitches[bufIndex] = midiNote;
+// Default settings for a session - those the GUI doesn't offer, and the
+// command line starts from
+void sessionConfigInit(SESSION_CONFIG* config)
+{
+    config->fftSize             = DEFAULT_FFT_SIZE;
+    config->windowType          = WINDOW_HANN;
+    config->overlapPct          = 50.0f;
+    config->numHarmonics        = NUM_HARMONICS;
+    config->lowPassOrder        = 1;
+    config->decimation          = 1;
+    config->tuning              = DEFAULT_TUNING;
+    config->numThreads          = 1;
+    
+    config->tempo               = 120;
+    config->keySig              = keyCMaj;
+    config->beatsPerBar         = 4;
+    config->noteDiv             = MIDI_NOTE_CROCHET;
+    config->quantisationFactor  = 1.0f;
+}
+
+// Gets a session ready to run with config - output/upload locations and
+// isRecording are left for the caller to fill in
+void sessionInit(SESSION* session, const SESSION_CONFIG* config)
+{
+    memset(session, 0, sizeof(SESSION));
     
-    bufIndex++; // Make sure to increase buffer index for next value
-    totalLen = bufIndex;
+    session->config = (*config);
+    atomic_init(&session->running, true);
+}
 
-    if (totalLen == MAX_NOTES)
+//////////////////////////////////////////////////////////////////////////////
+// Note store
+//
+// The notes found are kept as parallel arrays of pitches and lengths, which
+// double in size whenever they fill up - so a recording can go on for as
+// long as it likes, and the memory used follows the number of notes.
+
+// Adds a note (MIDI note number, or NOTE_REST) lasting length frames. Returns
+// false if there's no memory to grow the store, leaving it as it was.
+bool noteStoreAdd(NOTE_STORE* store, int pitch, int length)
+{
+    if (store->count == store->capacity)
     {
-        printf("\n[!] STOPPING: Buffer full!\n");
-        running = 0;
+        int capacity = (store->capacity > 0) ? store->capacity * 2 : NOTE_STORE_MIN;
+        
+        int* pitches = (int*)realloc(store->pitches, sizeof(int) * capacity);
+        
+        if (pitches == NULL)
+        {
+            return (false);
+        }
+        
+        store->pitches = pitches;
+        
+        int* lengths = (int*)realloc(store->lengths, sizeof(int) * capacity);
+        
+        if (lengths == NULL)
+        {
+            return (false);
+        }
+        
+        store->lengths = lengths;
+        store->capacity = capacity;
     }
+    
+    store->pitches[store->count] = pitch;
+    store->lengths[store->count] = length;
+    store->count++;
+    
+    return (true);
 }
 
-// Assign MIDI note values per pitch C3-C6
-void setMidiNotes()
+// Frees the store's arrays, leaving it empty
+void noteStoreFree(NOTE_STORE* store)
 {
-    // C3 is 36 in the MIDI library we're using.
-    // However other sources suggest C3 should be 48, 
-    // which is what C4 is set to.
-    // The MIDI (sheet) output is also an octave lower than expected when testing.
-    int c3 = MIDI_NOTE_C4;
+    free(store->pitches);
+    free(store->lengths);
     
-    int midiVal = c3;
-    
-    printf("\n=== MIDI TABLE ===\n");
-    
-    // 37 notes between C3-C6
-    for (int i = 0; i < 37; i++)
+    store->pitches = NULL;
+    store->lengths = NULL;
+    store->count = 0;
+    store->capacity = 0;
+}
+
+// Adds a note (MIDI note number, or NOTE_REST) to the session's output
+void pitchesAdd(SESSION* session, int pitch, int length)
+{    
+    if (!noteStoreAdd(&session->notes, pitch, length))
     {
-        midiNotes[i] = midiVal;
-        
-        printf("\n%s is %d", notes[i], midiNotes[i]);
-        
-        midiVal++;
+        printf("\n[!] STOPPING: Not enough memory for more notes!\n");
+        atomic_store(&session->running, false);
+    }
+    else
+    {
+        // Anything now settled goes straight out to the MIDI file
+        midiOutputNotes(session, false);
     }
-    
-    printf("\n===            ===\n");
 }
 
 // Returns the MIDI_NOTE equivalent based on the selected time signature
@@ -454,7 +581,7 @@ int getNoteType(float noteDur, float qNoteLen, float minPerSec)
 {           
     // qNoteLen represents the length in seconds a quarter note
     // (crotchet) is expected to be. We calculate this in
-    // outputMidi() below
+    // midiOutputOpen() below
     
     int noteType = 0;
     
@@ -564,297 +691,501 @@ tMIDI_KEYSIG getMIDIKey(const char* keySig)
     return (midiKey);
 }
 
-// Write the contents of the buffers to a MIDI file.
-void outputMidi(float frameTime)
-{        
+// Creates the session's MIDI file and writes its header and track setup,
+// ready for midiOutputNotes() to add notes as they're found. The file is
+// written out as it goes, so it has every note up to the last one written
+// even if the session never finishes. The track is kept in trackMem (of
+// trackMemSize bytes) while it fits, so writing it needn't touch the heap.
+bool midiOutputOpen(SESSION* session, float frameTime, void* trackMem, size_t trackMemSize)
+{
+    const SESSION_CONFIG* config = &session->config;
+    MIDI_OUTPUT* midi = &session->midi;
     int track = 1;
     
     // Try to create MIDI file
-    MIDI_FILE* midiOutput = midiFileCreate(fileOutputLoc, TRUE); // (True for overwrite file if exists)
+    midi->file = midiFileCreate(session->fileOutputLoc, TRUE); // (True for overwrite file if exists)
     
-    if (midiOutput)
+    if (midi->file == NULL)
     {
-        // Assign tempo.
-        // Starts at track 1.
-        midiSongAddTempo(midiOutput, track, tempoVal);
-        
-        // Set key signature.
-        midiSongAddKeySig(midiOutput, track, (tMIDI_KEYSIG)keySigVal);
-        
-        // Set current channel before writing data (only using one)
-        midiFileSetTracksDefaultChannel(midiOutput, track, MIDI_CHANNEL_1);
+        return (false);
+    }
+    
+    midiFileSetTrackArena(midi->file, trackMem, trackMemSize);
+    
+    // Assign tempo.
+    // Starts at track 1.
+    midiSongAddTempo(midi->file, track, config->tempo);
+    
+    // Set key signature.
+    midiSongAddKeySig(midi->file, track, config->keySig);
+    
+    // Set current channel before writing data (only using one)
+    midiFileSetTracksDefaultChannel(midi->file, track, MIDI_CHANNEL_1);
+    
+    // Set instrument. Not really essential for its end purpose
+    midiTrackAddProgramChange(midi->file, track, MIDI_PATCH_ELECTRIC_GRAND_PIANO);
+    
+    // Set time signature.
+    midiSongAddSimpleTimeSig(midi->file, track, config->beatsPerBar, config->noteDiv);
+    
+    // Write the track out as it goes, starting with the above
+    if (!midiFileStreamTrack(midi->file, track))
+    {
+        midiFileClose(midi->file);
+        midi->file = NULL;
         
-        // Set instrument. Not really essential for its end purpose
-        midiTrackAddProgramChange(midiOutput, track, MIDI_PATCH_ELECTRIC_GRAND_PIANO);
+        return (false);
+    }
+    
+    midi->written   = 0;
+    midi->frameTime = frameTime;
+    
+    // Get the minimum note length we're detecting using the length (secs) of a crotchet
+    midi->crotchetLen = 60.0f / (float)config->tempo;
+    
+    // Apply quantisation
+    midi->minPerSec = midi->crotchetLen / config->quantisationFactor;
+    
+    printf("\n[CROTCHET LEN: %f s \t QUANTISATION FACTOR NOTE LEN: %f s]\n", midi->crotchetLen, midi->minPerSec);
+    
+    return (true);
+}
+
+// Writes the notes in the session's store that haven't been written yet.
+// A note's length isn't settled until the next one is found (a rest after
+// it is added on), so the last note is held back unless final is set.
+void midiOutputNotes(SESSION* session, bool final)
+{
+    MIDI_OUTPUT* midi = &session->midi;
+    const NOTE_STORE* notes = &session->notes;
+    int track = 1;
+    int last = final ? notes->count : notes->count - 1;
+    
+    if (midi->file == NULL || midi->written >= last)
+    {
+        return;
+    }
+    
+    for (int i = midi->written; i < last; i++)
+    {
+        int tempLen = notes->lengths[i];
         
-        // Set time signature.
-        midiSongAddSimpleTimeSig(midiOutput, track, beatsPerBar, noteDiv);
+        // If next note is silence, combine with current note for improved rhythmic
+        // accuracy.
+        //
+        // This does not, however, capture performer articulation necessarily accurately,
+        // due to not displaying rests - but we are making a compromise.
+        if (i < notes->count - 1)
+        {
+            if (notes->pitches[i+1] == NOTE_REST)
+            {
+                tempLen += notes->lengths[i+1];
+            }
+        }
         
-        // Get the minimum note length we're detecting using the length (secs) of a crotchet
-        float crotchetLen = 60.0f / (float)tempoVal;
+        // Get note length by multiplying the duration of the frame
+        // by the number of frames the note persists for, then rounding
+        // this to the nearest smallest note value we want to detect - this
+        // is the quantisation factor.
+        float noteLen = (float)round((midi->frameTime * tempLen) / midi->minPerSec) * midi->minPerSec;
         
-        // Apply quantisation
-        float minPerSec = crotchetLen / quantisationFactor;
         
-        printf("\n[CROTCHET LEN: %f s \t QUANTISATION FACTOR NOTE LEN: %f s]\n", crotchetLen, minPerSec);        
+        // In case it rounds down to 0
+        if (noteLen == 0.0f)
+        {
+            noteLen = midi->minPerSec;
+        }
         
-        for (int i = 0; i < totalLen; i++)
+        // If not silence
+        if (notes->pitches[i] != NOTE_REST)
         {
-            int tempLen = recLengths[i];
-            
-            // If next note is silence, combine with current note for improved rhythmic
-            // accuracy.
-            //
-            // This does not, however, capture performer articulation necessarily accurately,
-            // due to not displaying rests - but we are making a compromise.
-            if (i < totalLen - 1)
-            {
-                if (strcmp(recPitches[i+1], "N/A") == 0)
-                {
-                    tempLen += recLengths[i+1];
-                }
-            }
-            
-            // Get note length by multiplying the duration of the frame
-            // by the number of frames the note persists for, then rounding
-            // this to the nearest smallest note value we want to detect - this
-            // is the quantisation factor.
-            float noteLen = (float)round((frameTime * tempLen) / minPerSec) * minPerSec;
-            
-            
-            // In case it rounds down to 0
-            if (noteLen == 0.0f)
-            {
-                noteLen = minPerSec;
-            }
-            
-            // If not silence
-            if (strcmp(recPitches[i], "N/A") != 0)
-            {
-                printf("\n====\nWriting (MIDI PITCH %d, ((float)round((%f * %d) / %f) * %f = %f)\n", recMidiPitches[i], frameTime, tempLen, minPerSec, minPerSec, noteLen);
-                midiTrackAddNote(midiOutput, track, recMidiPitches[i], getNoteType(noteLen, crotchetLen, minPerSec), MIDI_VOL_HALF, TRUE, FALSE);
-
-            }
+            printf("\n====\nWriting (MIDI PITCH %d, ((float)round((%f * %d) / %f) * %f = %f)\n", notes->pitches[i], midi->frameTime, tempLen, midi->minPerSec, midi->minPerSec, noteLen);
+            midiTrackAddNote(midi->file, track, notes->pitches[i], getNoteType(noteLen, midi->crotchetLen, midi->minPerSec), MIDI_VOL_HALF, TRUE, FALSE);
         }
-        midiFileClose(midiOutput);
-        printf("\nMIDI file successfully created.\n");
     }
-    else
+    
+    midi->written = last;
+    
+    // Out to disk, so the file's usable if the session goes no further
+    if (!midiFileStreamFlush(midi->file))
     {
-        // If MIDi file creation fails
-        printf("\n[!] ERROR: Failed to create MIDI file.\n");
+        printf("\n[!] WARNING: Failed to write to the MIDI file\n");
     }
 }
 
-// Displays the text of a PortAudio error
-void checkError(PaError err)
+// Writes the last of the notes and finishes the MIDI file
+void midiOutputClose(SESSION* session)
 {
-    if (err != paNoError)
+    MIDI_OUTPUT* midi = &session->midi;
+    
+    if (midi->file == NULL)
     {
-        printf("PortAudio error: %s\n", Pa_GetErrorText(err));
+        return;
     }
-}
-
-// Downsample the data and get the harmonic product spectrum output
-void harmonicProductSpectrum(fftwf_complex* result, float* outResult, int length)
-{
-    int outLength2 = getArrayLen(length, 2);
-    int outLength3 = getArrayLen(length, 3);
-    int outLength4 = getArrayLen(length, 4);
-    int outLength5 = getArrayLen(length, 5);
-    
-    // Downsample - compress spectrum 4x --> by 2, by 3, by 4 and by 5
-    float hps2[outLength2];
-    float hps3[outLength3];
-    float hps4[outLength4];
-    float hps5[outLength5];
     
-    downsample(result, hps2, outLength2, 2);
-    downsample(result, hps3, outLength3, 3);
-    downsample(result, hps4, outLength4, 4);
-    downsample(result, hps5, outLength5, 5);
+    midiOutputNotes(session, true);
     
-    for (int i = 0; i < outLength5; i++)
+    if (midiFileClose(midi->file))
     {
-        outResult[i] = sqrt(calcMagnitude(result[i][REAL], result[i][IMAG]) * calcMagnitude(hps2[i], 0.0f) * calcMagnitude(hps3[i], 0.0f) * calcMagnitude(hps4[i], 0.0f) * calcMagnitude(hps5[i], 0.0f));
+        printf("\nMIDI file successfully created.\n");
     }
+    else
+    {
+        printf("\n[!] ERROR: Failed to finish the MIDI file.\n");
+    }
+    
+    midi->file = NULL;
 }
 
-// Gets the array length for downsampled data depending on the
-// downsampling value (idx)
-int getArrayLen(int fftLen, int idx)
-{
-    int outLen = (int)ceil((float)((float)fftLen / idx));
-    return (outLen);
-}
-
-void downsample(const fftwf_complex* result, float* out, int outLength, int idx)
+// Displays the text of a PortAudio error
+void checkError(PaError err)
 {
-    for (int i = 0; i < outLength; i++)
+    if (err != paNoError)
     {
-        out[i] = result[i * idx][REAL];
+        printf("PortAudio error: %s\n", Pa_GetErrorText(err));
     }
 }
 
-/* FFTW3 complex array types are in the form
+/* Harmonic product spectrum
 *
-* typedef float fftwf_complex[2];
+* The magnitude spectrum is worked out once per frame, squared (no sqrt per
+* bin), then for each output bin the squared magnitudes at the bin and its
+* harmonics (2x, 3x ... numHarmonics x) are multiplied together. The product
+* is accumulated in double precision, which has the range for up to
+* MAX_HARMONICS large squared magnitudes. Its fourth root - the square root
+* of the product of the plain magnitudes - is the HPS output, as it has
+* always been.
 *
-* where 0 = real, 1 = imaginary
+* Each kernel has an AVX2 version and a scalar fallback that carries out the
+* same operations in the same order, so both give identical results.
 */
-void convertToComplexArray(float* samples, fftwf_complex* complex, int length)
-{    
-    for (int i = 0; i < length; i++)
+
+// Squared magnitudes of bins start to end. A magnitude of 0 counts as 1, so
+// an empty bin doesn't zero the product.
+static void hpsMagnitudes(const fftwf_complex* spectrum, float* magSq, int start, int end)
+{
+    for (int i = start; i < end; i++)
     {
-        // Every odd sample is the imaginary part - fill with 0s for now
-        complex[i][IMAG] = 0.0f;
+        float re = spectrum[i][REAL];
+        float im = spectrum[i][IMAG];
+        
+        magSq[i] = re * re + im * im;
         
-        // Every even sample is the real part
-        complex[i][REAL] = samples[i];
+        if (magSq[i] == 0.0f)
+        {
+            magSq[i] = 1.0f;
+        }
     }
 }
 
-// Calculates magnitude
-float calcMagnitude(float real, float imaginary)
+// HPS output for bins start to end
+static void hpsProduct(const float* magSq, float* outResult, int start, int end, int harmonics)
 {
-    float magnitude = sqrt(real * real + imaginary * imaginary);
-
-    if (magnitude == 0.0f) magnitude = 1.0f;
-    
-    return (magnitude);
+    for (int i = start; i < end; i++)
+    {
+        double product = magSq[i];
+        
+        for (int h = 2; h <= harmonics; h++)
+        {
+            product = product * (double)magSq[h * i];
+        }
+        
+        outResult[i] = (float)sqrt(sqrt(product));
+    }
 }
 
-// Prints the (estimated) pitch of a note based on a frequency.
-char* getPitch(float freq, int* midiNote)
-{    
-    char* pitch = NULL;
-    int found = 0;
+#ifdef PREPROCESS_SIMD
+// Multiplies and adds are kept separate (no FMA) to round exactly as the
+// scalar version does
+__attribute__((target("avx2")))
+static void hpsMagnitudesAvx2(const fftwf_complex* spectrum, float* magSq, int start, int end)
+{
+    const float*    in      = (const float*)spectrum;
+    __m256          one     = _mm256_set1_ps(1.0f);
+    int             i       = start;
     
-    float lastFreq = 0.0f;
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 a = _mm256_loadu_ps(in + 2 * i);
+        __m256 b = _mm256_loadu_ps(in + 2 * i + 8);
+        
+        // re * re + im * im of each bin - pairs of a and b are interleaved
+        // by 128-bit lane, so put them back in order
+        __m256 sum = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+        sum = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sum), _MM_SHUFFLE(3, 1, 2, 0)));
+        
+        sum = _mm256_blendv_ps(sum, one, _mm256_cmp_ps(sum, _mm256_setzero_ps(), _CMP_EQ_OQ));
+        
+        _mm256_storeu_ps(magSq + i, sum);
+    }
+    
+    hpsMagnitudes(spectrum, magSq, i, end);
+}
+
+__attribute__((target("avx2")))
+static void hpsProductAvx2(const float* magSq, float* outResult, int start, int end, int harmonics)
+{
+    int i = start;
     
-    if (freq < MAX_FREQUENCY)
+    for (; i + 8 <= end; i += 8)
     {
-        // 37 notes in range C3-C6
-        for (int i = 0; i < 37; i++)
+        __m256i bins    = _mm256_add_epi32(_mm256_set1_epi32(i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256  first   = _mm256_loadu_ps(magSq + i);
+        __m256d lo      = _mm256_cvtps_pd(_mm256_castps256_ps128(first));
+        __m256d hi      = _mm256_cvtps_pd(_mm256_extractf128_ps(first, 1));
+        
+        for (int h = 2; h <= harmonics; h++)
         {
-            if (i != 0)
-            {
-                lastFreq = frequencies[i-1];
-            }
+            // Gather the h-th harmonic of each of the 8 bins
+            __m256 harmonic = _mm256_i32gather_ps(magSq, _mm256_mullo_epi32(bins, _mm256_set1_epi32(h)), 4);
             
-            if (freq > lastFreq && freq < frequencies[i + 1])
-            {
-                if (abs(frequencies[i] - freq) < abs(frequencies[i + 1] - freq))
-                {
-                    pitch = notes[i];
-                    (*midiNote) = midiNotes[i];
-                    found = 1;
-                }
-            }
-            
-            if (found == 1)
-            {
-                break;
-            }  
+            lo = _mm256_mul_pd(lo, _mm256_cvtps_pd(_mm256_castps256_ps128(harmonic)));
+            hi = _mm256_mul_pd(hi, _mm256_cvtps_pd(_mm256_extractf128_ps(harmonic, 1)));
         }
         
-        if (pitch != NULL)
-        {
-            printf("\nNOTE DETECTED: %s (MIDI %d)", pitch, (*midiNote));
-        }
+        lo = _mm256_sqrt_pd(_mm256_sqrt_pd(lo));
+        hi = _mm256_sqrt_pd(_mm256_sqrt_pd(hi));
         
-        // Otherwise assume background noise (so no note)
+        _mm256_storeu_ps(outResult + i, _mm256_set_m128(_mm256_cvtpd_ps(hi), _mm256_cvtpd_ps(lo)));
     }
-    else
+    
+    hpsProduct(magSq, outResult, i, end, harmonics);
+}
+#endif
+
+// Works out which HPS output bins can hold a note in the playable range
+// (MIN_FREQUENCY - MAX_FREQUENCY), and so which bins of the spectrum the
+// HPS needs - the range's bins and their harmonics. numBins is the number of
+// bins in the spectrum (fft size / 2 + 1), binSize the width of each (Hz).
+BIN_RANGE getPeakBinRange(int numBins, int harmonics, float binSize)
+{
+    BIN_RANGE range;
+    
+    int outLength = getArrayLen(numBins, harmonics);
+    
+    // First bin above MIN_FREQUENCY, up to the first at or above MAX_FREQUENCY
+    range.first     = (int)(MIN_FREQUENCY / binSize) + 1;
+    range.last      = (int)ceil(MAX_FREQUENCY / binSize);
+    
+    if (range.last > outLength - 1)
     {
-        printf("[!] PITCH OUT OF RANGE\n");
+        range.last = outLength - 1;
     }
     
-    return (pitch);
+    range.spectrumEnd = harmonics * range.last + 1;
+    
+    return (range);
 }
 
-// Obtain the peak from the downsampled harmonic product spectrum
-// output.
-void hps_getPeak(float* dsResult, int len, bool isOnset)
+// Gets the harmonic product spectrum output from the half spectrum of the
+// real-to-complex FFT, for just the output bins in range (see
+// getPeakBinRange()) - only the parts of the spectrum those bins need are
+// looked at. scratch is working space for the squared magnitudes (see
+// getHpsScratchLen()). The largest spectra are split across threads.
+void harmonicProductSpectrum(fftwf_complex* result, float* outResult, const BIN_RANGE* range, float* scratch,
+                             int harmonics, int threads)
 {
-    float highest = 0.0f;
-    float current = 0.0f;
-    int peakBinNo = 0;
-    
-    float peakFreq = 0.0f;
+    float*  magSq   = scratch;
+    int     first   = range->first;
+    int     end     = range->last + 1;
     
-    static float prevAmplitude = 0.0f;  // Last recorded amplitude
-    static int noteLen = 0;             // Length of current note (number of iterations the "same note"
-                                        // has been tracked)
-    static int silenceLen = 0;          // Length of silence (no recognisable note being played)
-    static char prevPitch[4];
-    static int lastPeakBin = 0;
-    char* curPitch;
-    static int prevMidiNote = 0;
-    int curMidiNote = 0;
+    // Only worth splitting across threads for the largest FFT sizes
+    bool parallel = threads > 1 && range->spectrumEnd - first >= PARALLEL_MIN_SIZE / 2;
     
-    int newNote = 0;
-    int wasSilence = 0;
-    int lastNoteLen = 0;
+    int numChunks = (range->spectrumEnd - first + HPS_CHUNK - 1) / HPS_CHUNK;
     
-    float threshold = 0.3f;
+    #pragma omp parallel for if (parallel) num_threads(threads)
+    for (int c = 0; c < numChunks; c++)
+    {
+        int start   = first + c * HPS_CHUNK;
+        int stop    = (start + HPS_CHUNK < range->spectrumEnd) ? start + HPS_CHUNK : range->spectrumEnd;
+        
+#ifdef PREPROCESS_SIMD
+        if (simdLevel >= SIMD_AVX2)
+        {
+            hpsMagnitudesAvx2(result, magSq, start, stop);
+            continue;
+        }
+#endif
+        hpsMagnitudes(result, magSq, start, stop);
+    }
     
-    static int tempNoteBuf[100];
-    static int tempNoteCount[100];
+    numChunks = (end - first + HPS_CHUNK - 1) / HPS_CHUNK;
     
-    // Reset static values if a new recording/upload
-    if (firstRun)
+    #pragma omp parallel for if (parallel) num_threads(threads)
+    for (int c = 0; c < numChunks; c++)
     {
-        prevAmplitude = 0.0f;
-        noteLen = 0;
-
-        silenceLen = 0;
-        lastPeakBin = 0;
-        prevMidiNote = 0;
+        int start   = first + c * HPS_CHUNK;
+        int stop    = (start + HPS_CHUNK < end) ? start + HPS_CHUNK : end;
         
-        firstRun = 0;
+#ifdef PREPROCESS_SIMD
+        if (simdLevel >= SIMD_AVX2)
+        {
+            hpsProductAvx2(magSq, outResult, start, stop, harmonics);
+            continue;
+        }
+#endif
+        hpsProduct(magSq, outResult, start, stop, harmonics);
+    }
+}
+
+// Gets the array length for downsampled data depending on the
+// downsampling value (idx)
+int getArrayLen(int fftLen, int idx)
+{
+    int outLen = (int)ceil((float)((float)fftLen / idx));
+    return (outLen);
+}
+
+// Gets the (estimated) pitch of a note based on a frequency - the nearest
+// piano key, for A4 tuned to tuning (Hz). Works the key out directly from the
+// number of semitones from A4, so costs the same whatever the range of notes.
+// Returns the key's name, with its MIDI note number in midiNote, or NULL if
+// there's no note or it's off the keyboard.
+const char* getPitch(float freq, float tuning, int* midiNote)
+{    
+    if (freq <= 0.0f)
+    {
+        return (NULL); // Background noise (so no note)
     }
     
+    int key = TUNING_KEY + (int)lrintf(OCTAVE_SIZE * log2f(freq / tuning));
     
-    for (int i = 0; i < len; i++)
+    if (key < LOWEST_KEY || key >= LOWEST_KEY + NUM_KEYS)
+    {
+        printf("[!] PITCH OUT OF RANGE\n");
+        return (NULL);
+    }
+    
+    (*midiNote) = key;
+    
+    printf("\nNOTE DETECTED: %s (MIDI %d)", noteNames[key - LOWEST_KEY], key);
+    
+    return (noteNames[key - LOWEST_KEY]);
+}
+
+// Finds the peak of the HPS output for one frame, and estimates the
+// frequency of the note from it (0 if no note). Only looks at this frame,
+// so can be run for several frames at once. binSize is the width of each
+// bin (Hz).
+float hps_findPeak(const float* dsResult, const BIN_RANGE* range, float binSize, float* peakAmp)
+{
+    float highest = 0.0f;
+    float current = 0.0f;
+    int peakBinNo = 0;
+    
+    float peakFreq = 0.0f;
+    
+    // Only bins in the playable range (see getPeakBinRange())
+    for (int i = range->first; i <= range->last; i++)
     {
         current = dsResult[i];
         
-        if (current > highest && i * BIN_SIZE > MIN_FREQUENCY && current >= NOISE_FLOOR)
+        if (current > highest && current >= NOISE_FLOOR)
         {           
             highest = current;
             peakBinNo = i;
         }
     }
     
-    peakFreq = peakBinNo * BIN_SIZE;
+    peakFreq = peakBinNo * binSize;
     
     // Interpolate results if note detected
     if (peakFreq != 0.0f)
     {
         // Get 2 surrounding frequencies to the 
-        // peak and interpolate
+        // peak and interpolate. The range never starts at bin 0, so the
+        // peak always has a bin either side.
         float frequencies[2];
+        
+        int n = peakBinNo;
 
-        // Ensure peak is not at the edges of the window (should not occur anyway due to windowing)
-        if (peakBinNo != 0 && peakBinNo != len - 1)
-        {
-            int n = peakBinNo;
-
-            frequencies[0] = (n - 1) * BIN_SIZE;
-            frequencies[1] = (n + 1) * BIN_SIZE;
-        }
+        frequencies[0] = (n - 1) * binSize;
+        frequencies[1] = (n + 1) * binSize;
     
         peakFreq = interpolate(frequencies[0], frequencies[1]);
     }
     
+    *peakAmp = highest;
+    
+    return (peakFreq);
+}
+
+// Starts the votes for a new note. Counts left from earlier notes are
+// ignored rather than cleared (see PITCH_VOTES).
+void pitchVotesReset(PITCH_VOTES* votes)
+{
+    votes->note++;
+    votes->frames = 0;
+    votes->best = 0;
+}
+
+// Adds one frame's pitch (MIDI note number) to the votes
+void pitchVotesAdd(PITCH_VOTES* votes, int midiNote)
+{
+    int k = midiNote & (MIDI_NOTES - 1);
+    
+    if (votes->stamps[k] != votes->note)
+    {
+        votes->stamps[k] = votes->note;
+        votes->counts[k] = 0;
+        votes->firstFrame[k] = votes->frames;
+    }
+    
+    votes->counts[k]++;
+    votes->frames++;
+    
+    // Most frames wins - or if level, whichever was found first
+    int best = votes->best;
+    
+    if (votes->stamps[best] != votes->note
+        || votes->counts[k] > votes->counts[best]
+        || (votes->counts[k] == votes->counts[best] && votes->firstFrame[k] < votes->firstFrame[best]))
+    {
+        votes->best = k;
+    }
+}
+
+// The most common pitch found over the note
+int pitchVotesGet(const PITCH_VOTES* votes)
+{
+    return (votes->best);
+}
+
+// The note being tracked, to be stored once it ends - the most common pitch
+// found over it, or NOTE_REST for a rest
+int getTrackedNote(const NOTE_TRACKER* t)
+{
+    return (t->prevNote == NOTE_REST ? NOTE_REST : pitchVotesGet(&t->votes));
+}
+
+// Tracks notes from one frame's peak to the next. Frames must be passed in
+// order, as this carries on from the previous frame (session->tracker).
+void trackNote(SESSION* session, float peakFreq, float peakAmp, bool isOnset)
+{
+    NOTE_TRACKER* t = &session->tracker;
+    const char* curPitch;
+    int curMidiNote = 0;
+    
+    int newNote = 0;
+    int wasSilence = 0;
+    int lastNoteLen = 0;
+    
+    float threshold = 0.3f;
+    
     // Estimate the pitch based on the highest frequency reported
-    curPitch = getPitch(peakFreq, &curMidiNote);
+    curPitch = getPitch(peakFreq, session->config.tuning, &curMidiNote);
+    
+    // Anything that isn't a key on the keyboard is treated as silence
+    if (curPitch == NULL)
+    {
+        peakFreq = 0.0f;
+    }
     
     // If note detected - 
     if (peakFreq != 0.0f)
     {
-        if (silenceLen != 0)
+        if (t->silenceLen != 0)
         {
             wasSilence = 1; // Flag that there was silence
         }
@@ -877,38 +1208,33 @@ void hps_getPeak(float* dsResult, int len, bool isOnset)
         * This "length" value can then be used to calculate the actual note length.
         */
         
-        if (isOnset || prevAmplitude == 0.0f)
+        if (isOnset || t->prevAmplitude == 0.0f)
         {
             printf(" | (NEW note)"); // New note attack
-            lastNoteLen = noteLen;
-            noteLen = 1; // Reset note length
+            lastNoteLen = t->noteLen;
+            t->noteLen = 1; // Reset note length
             
             newNote = 1; // Flag new note
         }
         else
         {         
-            if (noteLen < 100)
-            {
-                tempNoteBuf[noteLen] = curMidiNote;
-                tempNoteCount[noteLen] = -1;
-            }
-            noteLen++;
+            pitchVotesAdd(&t->votes, curMidiNote);
+            t->noteLen++;
         }        
         
-        lastPeakBin = peakBinNo;
         
-        prevAmplitude = highest;        
+        t->prevAmplitude = peakAmp;
     }
     // Implies recording has just started - don't record silence until first note played
-    else if (prevAmplitude == 0.0f)
+    else if (t->prevAmplitude == 0.0f)
     {
         // Do nothing
     }
     // Else silence detected
     else
     {
-        silenceLen++;
-        lastNoteLen = noteLen;
+        t->silenceLen++;
+        lastNoteLen = t->noteLen;
     }
     
     // ------------------------------------------------------
@@ -916,120 +1242,43 @@ void hps_getPeak(float* dsResult, int len, bool isOnset)
     // If first note of the recording
     if (newNote && lastNoteLen == 0)
     {
-        strcpy(prevPitch, curPitch);
-        prevMidiNote = curMidiNote;
+        t->prevNote = curMidiNote;
         
-        tempNoteBuf[0] = prevMidiNote;
-        tempNoteCount[0] = -1;
+        pitchVotesReset(&t->votes);
+        pitchVotesAdd(&t->votes, t->prevNote);
     }
     // If a new note after a period of silence
     else if (newNote && wasSilence)
     {
-        pitchesAdd(prevPitch, silenceLen, prevMidiNote);
+        pitchesAdd(session, t->prevNote, t->silenceLen);
 
-        silenceLen = 0;
+        t->silenceLen = 0;
 
-        strcpy(prevPitch, curPitch);
-        prevMidiNote = curMidiNote;
+        t->prevNote = curMidiNote;
 
-        tempNoteBuf[0] = prevMidiNote;
-        tempNoteCount[0] = -1;
+        pitchVotesReset(&t->votes);
+        pitchVotesAdd(&t->votes, t->prevNote);
     }
     // If a new note (not the first) after another note, add the last note vals to buffers
     else if (newNote)
     {
-        // If note len > 100, only account for first 100 collected pitches (save on memory)
-        int iter = lastNoteLen > 100 ? 100 : lastNoteLen;
-
         // Where the detected frequency can sometimes fluctuate,
-        // get the most common detected note
-        for (int i = 0; i < iter; i++)
-        {
-            int count = 1;
-            
-            for (int j = i + 1; j < iter; j++)
-            {
-                if (tempNoteBuf[i] == tempNoteBuf[j])
-                {
-                    count++;
-                    tempNoteCount[j] = 0;
-                }
-            }
-            
-            if (tempNoteCount[i] != 0)
-            {
-                tempNoteCount[i] = count;
-            }
-        }
-        
-        int highest = 0;
-        int highestIdx = 0;
-
-        for (int i = 0; i < iter; i++)
-        {
-            if (tempNoteCount[i] > highest)
-            {
-                highest = tempNoteCount[i];
-                highestIdx = i;
-            }
-        }
-        
-        int realMidiNote = tempNoteBuf[highestIdx];
-
-        pitchesAdd(prevPitch, lastNoteLen, realMidiNote);
+        // use the most common detected note
+        pitchesAdd(session, getTrackedNote(t), lastNoteLen);
         
-        strcpy(prevPitch, curPitch);
-
-        prevMidiNote = curMidiNote;
+        t->prevNote = curMidiNote;
         
-        tempNoteBuf[0] = prevMidiNote;
-        tempNoteCount[0] = -1;
+        pitchVotesReset(&t->votes);
+        pitchVotesAdd(&t->votes, t->prevNote);
     }   
     // If we're starting a point of silence (rests), store the last pitch
-    else if (silenceLen == 1)
+    else if (t->silenceLen == 1)
     {
-        // If note len > 100, only account for first 100 collected pitches (save on memory)
-        int iter = lastNoteLen > 100 ? 100 : lastNoteLen;
-
         // Where the detected frequency can sometimes fluctuate,
-        // get the most common detected note
-        for (int i = 0; i < iter; i++)
-        {
-            int count = 1;
-            
-            for (int j = i + 1; j < iter; j++)
-            {
-                if (tempNoteBuf[i] == tempNoteBuf[j])
-                {
-                    count++;
-                    tempNoteCount[j] = 0;
-                }
-            }
-            
-            if (tempNoteCount[i] != 0)
-            {
-                tempNoteCount[i] = count;
-            }
-        }
-        
-        int highest = 0;
-        int highestIdx = 0;
-        
-        for (int i = 0; i < iter; i++)
-        {
-            if (tempNoteCount[i] > highest)
-            {
-                highest = tempNoteCount[i];
-                highestIdx = i;
-            }
-        }
-        
-        int realMidiNote = tempNoteBuf[highestIdx];
+        // use the most common detected note
+        pitchesAdd(session, getTrackedNote(t), lastNoteLen);
 
-        pitchesAdd(prevPitch, lastNoteLen, realMidiNote);
-
-        strcpy(prevPitch, "N/A");
-        prevMidiNote = 0;
+        t->prevNote = NOTE_REST;
     }
 }
 
@@ -1041,146 +1290,1539 @@ float interpolate(float first, float last)
     return (result);
 }
 
-// Simple first order low pass filter with a cutoff frequency
-void lowPassData(float* input, float* output, int length, int cutoff)
+//////////////////////////////////////////////////////////////////////////////
+// Low-pass filter
+//
+// The filter runs over the audio as one continuous stream, carrying its state
+// from one chunk of samples to the next, so every sample is filtered once
+// (however much the frames overlap) and frames don't start with a transient.
+//
+// It's a cascade of second order sections. Each is a recursive filter, so
+// every output depends on the last - to get around that the outputs are
+// worked out FILTER_BLOCK at a time, each directly from the block's inputs
+// and the state before the block (see filterSectionInit()). The outputs of a
+// block then no longer depend on each other, and are computed together with
+// SIMD.
+
+// Coefficient for a simple first order low pass filter with a cutoff
+// frequency, for audio at sampleRate
+float getLowPassAlpha(int cutoff, float sampleRate)
 {
     // Filter constant
     float rc = 1.0 / (cutoff * 2 * M_PI);    
     
-    float dt = 1.0 / SAMPLE_RATE;
+    float dt = 1.0 / sampleRate;
     
     // Filter coefficient (alpha) - between 0 and 1, where 0 is no smoothing, 1 is maximum.
     // Determines amount of smoothing to be applied
     float alpha = dt / (rc + dt);
     
-    output[0] = input[0];
-    
-    for (int i = 1; i < length; i++)
+    return (alpha);
+}
+
+// Sets up a section from its coefficients, for
+// y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2]
+void filterSectionInit(FILTER_SECTION* section, double b0, double b1, double b2, double a1, double a2)
+{
+    section->b0 = b0;
+    section->b1 = b1;
+    section->b2 = b2;
+    section->a1 = a1;
+    section->a2 = a2;
+    
+    // Block form: the outputs of a block are a weighted sum of the previous
+    // two inputs, the block's inputs and the previous two outputs. Each
+    // column of weights is the block's response to just that one value.
+    for (int col = 0; col < FILTER_BLOCK_COLS; col++)
     {
-        output[i] = alpha * input[i] + (1 - alpha) * output[i - 1];
+        double v[FILTER_BLOCK_COLS] = { 0.0 };
+        v[col] = 1.0;
+        
+        double x2 = v[0];
+        double x1 = v[1];
+        double y2 = v[FILTER_BLOCK + 2];
+        double y1 = v[FILTER_BLOCK + 3];
+        
+        section->used[col] = false;
+        
+        for (int k = 0; k < FILTER_BLOCK; k++)
+        {
+            double x = v[k + 2];
+            double y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+            
+            section->weights[col][k] = (float)y;
+            
+            if (section->weights[col][k] != 0.0f)
+            {
+                section->used[col] = true;
+            }
+            
+            x2 = x1;
+            x1 = x;
+            y2 = y1;
+            y1 = y;
+        }
     }
+    
+    section->x1 = section->x2 = section->y1 = section->y2 = 0.0f;
 }
 
-// Sets up the window using the Hann function
-void setUpHannWindow(float* windowData, int length)
+// Sets up the low-pass filter. Order 1 is the original single pole filter,
+// otherwise order (2, 4, 6 or 8) adds a Butterworth filter, made from
+// order / 2 sections. sampleRate is the rate of the audio it filters.
+//
+// cutoff is the highest fundamental wanted. The single pole filter rolls off
+// gently from there, which the HPS relies on. So every filter starts with it,
+// and the Butterworth sections come after, cutting off above the top of
+// numHarmonics harmonics (kept below the Nyquist frequency) - they only take
+// out what's above anything the HPS looks at.
+void filterInit(LOW_PASS_FILTER* filter, int order, int cutoff, int numHarmonics, float sampleRate)
 {
-    for (int i = 0; i < length; i++)
+    double alpha = getLowPassAlpha(cutoff, sampleRate);
+    
+    filter->numSections = 1;
+    filterSectionInit(&filter->sections[0], alpha, 0.0, 0.0, -(1.0 - alpha), 0.0);
+    
+    if (order < 2)
+    {
+        return;
+    }
+    
+    double fc = (double)cutoff * numHarmonics;
+    
+    if (fc > BUTTERWORTH_MAX_CUTOFF * sampleRate)
     {
-        // Hann function
-        windowData[i] = 0.5 * (1.0 - cos(2 * M_PI * i / (length - 1.0)));
+        fc = BUTTERWORTH_MAX_CUTOFF * sampleRate;
+    }
+    
+    double w0 = 2.0 * M_PI * fc / sampleRate;
+    int pairs = (order / 2 < MAX_FILTER_SECTIONS - 1) ? order / 2 : MAX_FILTER_SECTIONS - 1;
+    
+    for (int k = 0; k < pairs; k++)
+    {
+        // Q of each pair of Butterworth poles
+        double q        = 1.0 / (2.0 * sin(M_PI * (2 * k + 1) / (4.0 * pairs)));
+        double alpha    = sin(w0) / (2.0 * q);
+        double a0       = 1.0 + alpha;
+        
+        filterSectionInit(&filter->sections[filter->numSections++],
+                          (1.0 - cos(w0)) / 2.0 / a0,
+                          (1.0 - cos(w0)) / a0,
+                          (1.0 - cos(w0)) / 2.0 / a0,
+                          -2.0 * cos(w0) / a0,
+                          (1.0 - alpha) / a0);
     }
 }
 
-// Applies Hann window to samples
-void setWindow(float* windowData, float* samples, int length)
+// Starts the filter off as if the stream had always been at value, so the
+// first output is value (as it always was at the start of a frame).
+void filterReset(LOW_PASS_FILTER* filter, float value)
 {
-    for (int i = 0; i < length; i++)
+    for (int k = 0; k < filter->numSections; k++)
     {
-        // Apply windowing function to the data
-        samples[i] = samples[i] * windowData[i];
+        FILTER_SECTION* section = &filter->sections[k];
+        
+        section->x1 = section->x2 = section->y1 = section->y2 = value;
     }
 }
 
-// Sets up input PaStreamParameters
-void configureInParams(int inpDevice, PaStreamParameters* i)
+// One block of a section from the weights - the same operations, in the same
+// order, as the SIMD versions
+static void filterBlock(const FILTER_SECTION* section, const float* v, float* output)
 {
-    memset(i, 0, sizeof(i));
-    
-    printf("Input device selected: %s (device %d)\n", Pa_GetDeviceInfo(inpDevice)->name, inpDevice);
-
-    i->channelCount = CHANNELS; // 1 (mono)
-
-    i->device = inpDevice;
-    i->hostApiSpecificStreamInfo = NULL;
-    i->sampleFormat = paFloat32; // FP values between 0.0-1.0
-    i->suggestedLatency = Pa_GetDeviceInfo(inpDevice)->defaultHighInputLatency;
+    for (int k = 0; k < FILTER_BLOCK; k++)
+    {
+        float sum = 0.0f;
+        
+        for (int col = 0; col < FILTER_BLOCK_COLS; col++)
+        {
+            if (section->used[col])
+            {
+                sum = sum + section->weights[col][k] * v[col];
+            }
+        }
+        
+        output[k] = sum;
+    }
 }
 
-// Save 50% of the samples from previous run for the next run
-// for 50% window overlap
-void saveOverlappedSamples(const float* samples, float* overlapPrev, int len)
+#ifdef PREPROCESS_SIMD
+__attribute__((target("sse")))
+static void filterBlockSse(const FILTER_SECTION* section, const float* v, float* output)
 {
-    // Save 2nd half of current samples for next iteration
-    for (int i = 0; i < len / 2; i++)
+    __m128 lo = _mm_setzero_ps();
+    __m128 hi = _mm_setzero_ps();
+    
+    for (int col = 0; col < FILTER_BLOCK_COLS; col++)
     {
-        overlapPrev[i] = samples[len/2 + i];
+        if (section->used[col])
+        {
+            __m128 value = _mm_set1_ps(v[col]);
+            
+            lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(section->weights[col]), value));
+            hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(section->weights[col] + 4), value));
+        }
     }
+    
+    _mm_storeu_ps(output, lo);
+    _mm_storeu_ps(output + 4, hi);
 }
 
-// Overlap the windows at 50%
-void overlapWindow(const float* nextSamples, const float* overlapPrev, float* newSamples, int len)
+// Multiplies and adds are kept separate (no FMA) to round exactly as the
+// scalar version does
+__attribute__((target("avx2")))
+static void filterBlockAvx2(const FILTER_SECTION* section, const float* v, float* output)
 {
-    // First half is the latter half of the previous
-    // frame's samples
-    for (int i = 0; i < len / 2; i++)
+    __m256 sum = _mm256_setzero_ps();
+    
+    for (int col = 0; col < FILTER_BLOCK_COLS; col++)
     {
-        newSamples[i] = overlapPrev[i];
+        if (section->used[col])
+        {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(section->weights[col]), _mm256_set1_ps(v[col])));
+        }
     }
+    
+    _mm256_storeu_ps(output, sum);
+}
+#endif
 
-    // Second half is the former half of the next
-    // frame's samples
-    for (int i = len / 2; i < len; i++)
+// Filters len samples of the stream (input and output may be the same)
+void filterProcess(LOW_PASS_FILTER* filter, const float* input, float* output, int len)
+{
+    for (int s = 0; s < filter->numSections; s++)
     {
-        newSamples[i] = nextSamples[i - len/2];
+        FILTER_SECTION* section = &filter->sections[s];
+        const float*    in      = (s == 0) ? input : output;
+        
+        float v[FILTER_BLOCK_COLS];
+        int i = 0;
+        
+        for (; i + FILTER_BLOCK <= len; i += FILTER_BLOCK)
+        {
+            v[0] = section->x2;
+            v[1] = section->x1;
+            memcpy(v + 2, in + i, sizeof(float) * FILTER_BLOCK);
+            v[FILTER_BLOCK + 2] = section->y2;
+            v[FILTER_BLOCK + 3] = section->y1;
+            
+#ifdef PREPROCESS_SIMD
+            if (simdLevel >= SIMD_AVX2)
+            {
+                filterBlockAvx2(section, v, output + i);
+            }
+            else if (simdLevel >= SIMD_SSE)
+            {
+                filterBlockSse(section, v, output + i);
+            }
+            else
+#endif
+            {
+                filterBlock(section, v, output + i);
+            }
+            
+            section->x2 = v[FILTER_BLOCK];
+            section->x1 = v[FILTER_BLOCK + 1];
+            section->y2 = output[i + FILTER_BLOCK - 2];
+            section->y1 = output[i + FILTER_BLOCK - 1];
+        }
+        
+        // Anything left over is filtered sample by sample
+        for (; i < len; i++)
+        {
+            float x = in[i];
+            float y = section->b0 * x + section->b1 * section->x1 + section->b2 * section->x2
+                    - section->a1 * section->y1 - section->a2 * section->y2;
+            
+            section->x2 = section->x1;
+            section->x1 = x;
+            section->y2 = section->y1;
+            section->y1 = y;
+            
+            output[i] = y;
+        }
     }
 }
 
-// Main function for processing microphone data.
-void* record(void* args)
+//////////////////////////////////////////////////////////////////////////////
+// Decimation
+//
+// Notes only go up to MAX_FREQUENCY, so with few enough harmonics most of the
+// spectrum at SAMPLE_RATE is never looked at. Decimating the stream by
+// decimation before framing gives the same frequency resolution from a
+// smaller FFT. Uploads recorded faster than SAMPLE_RATE are decimated
+// further, so they're analysed at much the same rate as everything else.
+// The stream is first low-pass filtered below the new Nyquist frequency, so
+// nothing above it aliases down - by a linear phase FIR (windowed sinc), of
+// which only every factor'th output is worked out. The HPS needs each
+// harmonic it multiplies below the new Nyquist frequency too, so decimating
+// far enough lowers the harmonics used.
+
+// Factor to decimate audio at rate by, on top of the chosen decimation, so
+// it's analysed at SAMPLE_RATE or a little above - e.g. 2 for 44.1 or 48 kHz.
+// Anything slower than 2 * SAMPLE_RATE is analysed at its own rate.
+int getRateFactor(int rate)
 {
-    bool firstRun = true;
+    int factor = rate / SAMPLE_RATE;
     
-    // Buffer to store audio samples
-    float samples[WINDOW_SIZE];
-    float nextSamples[WINDOW_SIZE];
-    
-    // Buffer to store samples to be overlapped with the previous
-    // buffer of samples
-    float overlapPrev[WINDOW_SIZE/2];
-    
-    // Buffer to store samples with overlap applied
-    float newSamples[WINDOW_SIZE];
+    return ((factor > 1) ? factor : 1);
+}
 
-    // Save the pre-read samples for the next cycle
-    float savedNextSamples[WINDOW_SIZE];
-    
-    float lowPassedSamples[WINDOW_SIZE];
-    float window[WINDOW_SIZE];
+// Most harmonics the HPS can use at rate - numHarmonics times the highest
+// note has to stay below the Nyquist frequency
+int getMaxHarmonics(float rate)
+{
+    int harmonics = (int)(rate / 2.0f / MAX_FREQUENCY);
     
-    // FFTW3 input and output array definitions, initialisation
-    fftwf_complex*   inp;
-    fftwf_complex*   outp;
-    fftwf_plan       plan;   // Contains all data needed for computing FFT
+    return ((harmonics < MAX_HARMONICS) ? harmonics : MAX_HARMONICS);
+}
 
-    // For reading from/writing to .wav to save user recording for 
-    // analysis
-    TinyWav tw;
+// Filter length for a factor, padded to a multiple of 8
+int getDecimatorTaps(int factor)
+{
+    return ((DECIMATION_TAPS * factor + 1 + 7) & ~7);
+}
 
-    // OnsetsDS struct - onset detection
-    OnsetsDS ods;
+// Floats of memory a decimator needs - its taps, then its history
+int getDecimatorMemLen(int factor)
+{
+    return (getDecimatorTaps(factor) + getDecimatorTaps(factor) - 1 + DECIMATION_CHUNK);
+}
+
+// Sets up the decimator for a factor of 1 (off) or more, in memory of
+// getDecimatorMemLen(factor) floats. The cutoff is DECIMATION_CUTOFF of the
+// decimated Nyquist frequency, and the transition band runs from about 3/4
+// of it up to the Nyquist frequency itself, so nothing aliases.
+void decimatorInit(DECIMATOR* dec, int factor, float* memory)
+{
+    int length  = DECIMATION_TAPS * factor + 1;
+    double fc   = DECIMATION_CUTOFF * 0.5 / factor;   // Cutoff (cycles per input sample)
+    double sum  = 0.0;
     
-    inp = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * WINDOW_SIZE);
-    outp = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * WINDOW_SIZE);
-    plan = fftwf_plan_dft_1d(WINDOW_SIZE, inp, outp, FFTW_FORWARD, FFTW_ESTIMATE); // 1D DFT of size WINDOW_SIZE
+    dec->factor     = factor;
+    dec->taps       = getDecimatorTaps(factor);
+    dec->coeffs     = memory;
+    dec->history    = memory + dec->taps;
     
-    // Allocate memory for ODS - onset detection
-    float* odsData = (float*)malloc(onsetsds_memneeded(ODS_ODF_RCOMPLEX, WINDOW_SIZE, MEDIAN_SPAN));
-    onsetsds_init(&ods, odsData, ODS_FFT_FFTW3_HC, ODS_ODF_RCOMPLEX, WINDOW_SIZE, MEDIAN_SPAN, SAMPLE_RATE);
+    memset(dec->coeffs, 0, sizeof(float) * dec->taps);
     
-    // Prepare window
-    setUpHannWindow(window, WINDOW_SIZE);
+    if (factor < 2)
+    {
+        return;
+    }
     
-    // This will store the total number of samples in our .wav
-    int totalSamples = 0;
+    // Taps are stored after the padding, so the filter is aligned with the
+    // newest input
+    float* coeffs = dec->coeffs + (dec->taps - length);
     
-    int numFrames = 0;  // Number of times samples are collected
-                        // (total number of frames processed)
-                        
-    int     dsSize  = 0;        // Size of buffer after downsampling (for HPS)
-    bool    onset   = false;    // Onset flag
+    for (int k = 0; k < length; k++)
+    {
+        double m = k - (length - 1) / 2.0;
+        double r = 2.0 * k / (length - 1.0) - 1.0;
+        double h = (m == 0.0) ? 2.0 * fc : sin(2.0 * M_PI * fc * m) / (M_PI * m);
+        
+        h *= besselI0(DECIMATION_BETA * sqrt(1.0 - r * r)) / besselI0(DECIMATION_BETA);
+        
+        coeffs[k] = h;
+        sum += h;
+    }
     
+    // Unity gain at DC
+    for (int k = 0; k < length; k++)
+    {
+        coeffs[k] /= sum;
+    }
+}
+
+// Starts the decimator off as if the stream had always been at value. The
+// next output is worked out when the first input arrives.
+void decimatorReset(DECIMATOR* dec, float value)
+{
+    for (int i = 0; i < dec->taps - 1; i++)
+    {
+        dec->history[i] = value;
+    }
+    
+    dec->held = dec->taps - 1;
+    dec->next = dec->taps - 1;
+}
+
+// One output - the dot product of the taps with the inputs they cover. Eight
+// running sums, added up in the same order as the SIMD versions.
+static float decimatorOutput(const float* coeffs, const float* input, int taps)
+{
+    float acc[8] = { 0.0f };
+    
+    for (int i = 0; i < taps; i += 8)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            acc[j] += coeffs[i + j] * input[i + j];
+        }
+    }
+    
+    return ((acc[0] + acc[4] + (acc[2] + acc[6])) + (acc[1] + acc[5] + (acc[3] + acc[7])));
+}
+
+#ifdef PREPROCESS_SIMD
+__attribute__((target("sse")))
+static float decimatorOutputSse(const float* coeffs, const float* input, int taps)
+{
+    __m128 lo = _mm_setzero_ps();
+    __m128 hi = _mm_setzero_ps();
+    
+    for (int i = 0; i < taps; i += 8)
+    {
+        lo = _mm_add_ps(lo, _mm_mul_ps(_mm_loadu_ps(coeffs + i), _mm_loadu_ps(input + i)));
+        hi = _mm_add_ps(hi, _mm_mul_ps(_mm_loadu_ps(coeffs + i + 4), _mm_loadu_ps(input + i + 4)));
+    }
+    
+    __m128 sum = _mm_add_ps(lo, hi);
+    
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    
+    return (_mm_cvtss_f32(sum));
+}
+
+__attribute__((target("avx2")))
+static float decimatorOutputAvx2(const float* coeffs, const float* input, int taps)
+{
+    __m256 acc = _mm256_setzero_ps();
+    
+    for (int i = 0; i < taps; i += 8)
+    {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(coeffs + i), _mm256_loadu_ps(input + i)));
+    }
+    
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    
+    return (_mm_cvtss_f32(sum));
+}
+#endif
+
+// Decimates len samples of the stream into output, returning the number of
+// outputs (len / factor, if len is a multiple of the factor). output can be
+// the same as input.
+int decimatorProcess(DECIMATOR* dec, const float* input, int len, float* output)
+{
+    int count = 0;
+    
+    while (len > 0)
+    {
+        int n = (len < DECIMATION_CHUNK) ? len : DECIMATION_CHUNK;
+        int i = dec->next;
+        
+        memcpy(dec->history + dec->held, input, sizeof(float) * n);
+        dec->held += n;
+        input += n;
+        len -= n;
+        
+        for (; i < dec->held; i += dec->factor)
+        {
+            const float* span = dec->history + i - (dec->taps - 1);
+            
+#ifdef PREPROCESS_SIMD
+            if (simdLevel >= SIMD_AVX2)
+            {
+                output[count++] = decimatorOutputAvx2(dec->coeffs, span, dec->taps);
+            }
+            else if (simdLevel >= SIMD_SSE)
+            {
+                output[count++] = decimatorOutputSse(dec->coeffs, span, dec->taps);
+            }
+            else
+#endif
+            {
+                output[count++] = decimatorOutput(dec->coeffs, span, dec->taps);
+            }
+        }
+        
+        // Keep the inputs the next outputs still need
+        int drop = dec->held - (dec->taps - 1);
+        
+        memmove(dec->history, dec->history + drop, sizeof(float) * (dec->taps - 1));
+        dec->held -= drop;
+        dec->next = i - drop;
+    }
+    
+    return (count);
+}
+
+// Everything the stream goes through before framing - decimation (if on),
+// then the low-pass filter. start resets both for the start of a stream.
+// output can be the same as input. Returns the number of samples written to
+// output.
+int conditionSamples(DECIMATOR* dec, LOW_PASS_FILTER* filter, const float* input, int len, float* output, bool start)
+{
+    if (dec->factor > 1)
+    {
+        if (start)
+        {
+            decimatorReset(dec, input[0]);
+        }
+        
+        len = decimatorProcess(dec, input, len, output);
+        input = output;
+    }
+    
+    if (start && len > 0)
+    {
+        filterReset(filter, input[0]);
+    }
+    
+    filterProcess(filter, input, output, len);
+    
+    return (len);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Window functions
+
+// Zeroth order modified Bessel function of the first kind, for the Kaiser
+// window
+double besselI0(double x)
+{
+    double sum  = 1.0;
+    double term = 1.0;
+    
+    for (int k = 1; k < 50; k++)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        
+        if (term < sum * 1e-12)
+        {
+            break;
+        }
+    }
+    
+    return (sum);
+}
+
+// Fills windowData with a window function of the given type
+void setUpWindow(float* windowData, int length, int type)
+{
+    for (int i = 0; i < length; i++)
+    {
+        double phase = 2 * M_PI * i / (length - 1.0);
+        
+        switch (type)
+        {
+            case WINDOW_HAMMING:
+                windowData[i] = 0.54 - 0.46 * cos(phase);
+                break;
+                
+            case WINDOW_BLACKMAN_HARRIS:
+                // 4-term, sidelobes around -92 dB
+                windowData[i] = 0.35875 - 0.48829 * cos(phase) + 0.14128 * cos(2 * phase) - 0.01168 * cos(3 * phase);
+                break;
+                
+            case WINDOW_KAISER:
+            {
+                double r = 2.0 * i / (length - 1.0) - 1.0;
+                windowData[i] = besselI0(KAISER_BETA * sqrt(1.0 - r * r)) / besselI0(KAISER_BETA);
+                break;
+            }
+            
+            default:
+                // Hann function
+                windowData[i] = 0.5 * (1.0 - cos(phase));
+                break;
+        }
+    }
+}
+
+// Gets the table for a window of the given type and size, building it the
+// first time it's asked for. Tables are 64-byte aligned and shared by every
+// session, so must not be written to. Returns NULL for an unsupported type
+// or size.
+const float* getWindow(int type, int size)
+{
+    int idx = getFftSizeIdx(size);
+    
+    if (idx < 0 || type < 0 || type >= NUM_WINDOW_TYPES)
+    {
+        return (NULL);
+    }
+    
+    pthread_mutex_lock(&windowLock);
+    
+    if (windowTables[type][idx] == NULL)
+    {
+        float* table = (float*)aligned_alloc(ARENA_ALIGN, ARENA_ROUND(sizeof(float) * size));
+        
+        if (table != NULL)
+        {
+            setUpWindow(table, size, type);
+        }
+        
+        windowTables[type][idx] = table;
+    }
+    
+    const float* window = windowTables[type][idx];
+    
+    pthread_mutex_unlock(&windowLock);
+    
+    return (window);
+}
+
+// Looks up a window type by name (as in windowNames). Returns -1 if unknown.
+int getWindowType(const char* name)
+{
+    for (int i = 0; i < NUM_WINDOW_TYPES; i++)
+    {
+        if (strcasecmp(name, windowNames[i]) == 0)
+        {
+            return (i);
+        }
+    }
+    
+    return (-1);
+}
+
+// Frees all window tables
+void windowsCleanup(void)
+{
+    pthread_mutex_lock(&windowLock);
+    
+    for (int type = 0; type < NUM_WINDOW_TYPES; type++)
+    {
+        for (int i = 0; i < NUM_FFT_SIZES; i++)
+        {
+            free(windowTables[type][i]);
+            windowTables[type][i] = NULL;
+        }
+    }
+    
+    pthread_mutex_unlock(&windowLock);
+}
+
+/* Pre-FFT kernels
+*
+* Apply the window to a frame of (already filtered) samples, writing the
+* result to the FFT input.
+*/
+
+// Scalar version
+void preprocessFrame(const float* input, float* output, const float* window, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        output[i] = input[i] * window[i];
+    }
+}
+
+#ifdef PREPROCESS_SIMD
+__attribute__((target("sse")))
+static void preprocessFrameSse(const float* input, float* output, const float* window, int length)
+{
+    for (int i = 0; i < length; i += 4)
+    {
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_loadu_ps(input + i), _mm_load_ps(window + i)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void preprocessFrameAvx2(const float* input, float* output, const float* window, int length)
+{
+    for (int i = 0; i < length; i += 8)
+    {
+        _mm256_storeu_ps(output + i, _mm256_mul_ps(_mm256_loadu_ps(input + i), _mm256_load_ps(window + i)));
+    }
+}
+#endif
+
+// Picks the widest kernels the CPU supports
+void preprocessInit(void)
+{
+    simdLevel = SIMD_SCALAR;
+    
+#ifdef PREPROCESS_SIMD
+    __builtin_cpu_init();
+    
+    if (__builtin_cpu_supports("avx2"))
+    {
+        simdLevel = SIMD_AVX2;
+    }
+    else if (__builtin_cpu_supports("sse"))
+    {
+        simdLevel = SIMD_SSE;
+    }
+#endif
+}
+
+// Windows count frames (input[k], length samples each) into consecutive
+// frames of output. Lengths must be a multiple of 8.
+void preprocessFrames(const float** input, float* output, int count, const float* window, int length)
+{
+    for (int k = 0; k < count; k++)
+    {
+#ifdef PREPROCESS_SIMD
+        if (simdLevel >= SIMD_AVX2)
+        {
+            preprocessFrameAvx2(input[k], output + k * length, window, length);
+        }
+        else if (simdLevel >= SIMD_SSE)
+        {
+            preprocessFrameSse(input[k], output + k * length, window, length);
+        }
+        else
+#endif
+        {
+            preprocessFrame(input[k], output + k * length, window, length);
+        }
+    }
+}
+
+// Sets up input PaStreamParameters
+void configureInParams(int inpDevice, PaStreamParameters* i)
+{
+    memset(i, 0, sizeof(i));
+    
+    printf("Input device selected: %s (device %d)\n", Pa_GetDeviceInfo(inpDevice)->name, inpDevice);
+
+    i->channelCount = CHANNELS; // 1 (mono)
+
+    i->device = inpDevice;
+    i->hostApiSpecificStreamInfo = NULL;
+    i->sampleFormat = paFloat32; // FP values between 0.0-1.0
+    // The callback only copies into the ring buffer, so it can run at low latency
+    i->suggestedLatency = Pa_GetDeviceInfo(inpDevice)->defaultLowInputLatency;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// FFT plans
+//
+// One real-to-complex plan is built for each supported FFT size when the
+// program starts, and kept until it exits. Plans are measured rather than
+// estimated so they use the fastest codelets for this CPU. The measurements
+// (FFTW "wisdom") are saved to a cache file, so later runs get the same plans
+// back straight away instead of measuring again.
+
+// Distance between the spectra of consecutive frames in a block. Padded from
+// fftSize / 2 + 1 up to a multiple of 8 bins (64 bytes), so every spectrum in
+// the block has the same alignment for the FFT's SIMD code.
+int getSpectrumStride(int fftSize)
+{
+    return ((fftSize / 2 + 1 + 7) & ~7);
+}
+
+// Gets the slot in fftPlans[] for an FFT size, or -1 if it isn't supported
+int getFftSizeIdx(int fftSize)
+{
+    int idx = 0;
+    
+    for (int size = MIN_FFT_SIZE; size <= MAX_FFT_SIZE; size *= 2, idx++)
+    {
+        if (size == fftSize)
+        {
+            return (idx);
+        }
+    }
+    
+    return (-1);
+}
+
+// Builds the plan for howMany frames of one FFT size, laid out one after
+// another in the input and getSpectrumStride() apart in the output. The
+// planner overwrites the arrays it is given while measuring, so it is run on
+// scratch arrays - the plan is later run on record()'s arrays with
+// fftwf_execute_dft_r2c().
+//
+// Single frame plans for sizes of PARALLEL_MIN_SIZE and above are split
+// across planThreads threads, as they are used for live recordings, which are
+// analysed a frame at a time. Smaller FFTs are quicker on one thread, and
+// block plans are used for uploads, which are shared out across threads a
+// block at a time instead.
+fftwf_plan createFftPlan(int fftSize, int howMany)
+{
+    int stride = getSpectrumStride(fftSize);
+    
+    float*          inp     = (float*)fftwf_malloc(sizeof(float) * fftSize * howMany);
+    fftwf_complex*  outp    = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * stride * howMany);
+    
+    fftwf_plan_with_nthreads(fftSize >= PARALLEL_MIN_SIZE && howMany == 1 ? planThreads : 1);
+    
+    // Try the saved wisdom first, and only measure if it has nothing suitable
+    fftwf_plan plan = fftwf_plan_many_dft_r2c(1, &fftSize, howMany,
+                                              inp, NULL, 1, fftSize,
+                                              outp, NULL, 1, stride,
+                                              FFT_PLAN_RIGOUR | FFTW_WISDOM_ONLY);
+    
+    if (plan == NULL)
+    {
+        plan = fftwf_plan_many_dft_r2c(1, &fftSize, howMany,
+                                       inp, NULL, 1, fftSize,
+                                       outp, NULL, 1, stride,
+                                       FFT_PLAN_RIGOUR);
+        wisdomChanged = true;
+    }
+    
+    fftwf_free(inp);
+    fftwf_free(outp);
+    
+    return (plan);
+}
+
+// Loads the saved wisdom and builds the plans for the usual FFT sizes (up to
+// PRELOAD_MAX_FFT_SIZE). Call once at startup, before any processing starts,
+// and after planThreads has been set.
+void fftPlansInit(void)
+{
+    const char* home = getenv("HOME");
+    
+    if (!fftwf_init_threads())
+    {
+        printf("[!] WARNING: FFTW threads unavailable - FFTs will run on one thread\n");
+    }
+    
+    // Cache file lives in the user's home directory
+    snprintf(wisdomLoc, sizeof(wisdomLoc), "%s/%s", home != NULL ? home : ".", WISDOM_FILE);
+    
+    if (!fftwf_import_wisdom_from_filename(wisdomLoc))
+    {
+        printf("No saved FFT wisdom - measuring FFT plans, this may take a moment...\n");
+    }
+    
+    pthread_mutex_lock(&planLock);
+    
+    for (int size = MIN_FFT_SIZE; size <= PRELOAD_MAX_FFT_SIZE; size *= 2)
+    {
+        int idx = getFftSizeIdx(size);
+        
+        if (fftPlans[idx] == NULL)
+        {
+            fftPlans[idx] = createFftPlan(size, 1);
+        }
+        
+        if (fftBlockPlans[idx] == NULL)
+        {
+            fftBlockPlans[idx] = createFftPlan(size, FFT_BLOCK_FRAMES);
+        }
+    }
+    
+    pthread_mutex_unlock(&planLock);
+    
+    // Save any new measurements for next time
+    if (wisdomChanged && !fftwf_export_wisdom_to_filename(wisdomLoc))
+    {
+        printf("[!] WARNING: Could not save FFT wisdom to %s\n", wisdomLoc);
+    }
+    
+    wisdomChanged = false;
+}
+
+// Gets the plan for one frame (howMany = 1) or a block of FFT_BLOCK_FRAMES
+// frames of an FFT size, building it if it hasn't been already. The FFTW
+// planner isn't thread safe, so building is done under a lock.
+fftwf_plan getFftPlan(int fftSize, int howMany)
+{
+    int idx = getFftSizeIdx(fftSize);
+    
+    if (idx < 0 || (howMany != 1 && howMany != FFT_BLOCK_FRAMES))
+    {
+        return (NULL);
+    }
+    
+    fftwf_plan* plans = (howMany == 1) ? fftPlans : fftBlockPlans;
+    
+    pthread_mutex_lock(&planLock);
+    
+    if (plans[idx] == NULL)
+    {
+        plans[idx] = createFftPlan(fftSize, howMany);
+        
+        // Save any new measurements for next time
+        if (wisdomChanged && fftwf_export_wisdom_to_filename(wisdomLoc))
+        {
+            wisdomChanged = false;
+        }
+    }
+    
+    fftwf_plan plan = plans[idx];
+    
+    pthread_mutex_unlock(&planLock);
+    
+    return (plan);
+}
+
+// Frees all plans - call once processing has finished for good
+void fftPlansCleanup(void)
+{
+    pthread_mutex_lock(&planLock);
+    
+    for (int i = 0; i < NUM_FFT_SIZES; i++)
+    {
+        if (fftPlans[i] != NULL)
+        {
+            fftwf_destroy_plan(fftPlans[i]);
+            fftPlans[i] = NULL;
+        }
+        
+        if (fftBlockPlans[i] != NULL)
+        {
+            fftwf_destroy_plan(fftBlockPlans[i]);
+            fftBlockPlans[i] = NULL;
+        }
+    }
+    
+    pthread_mutex_unlock(&planLock);
+    
+    // Also stops FFTW's worker threads
+    fftwf_cleanup_threads();
+}
+
+// Samples between the starts of successive frames, for the session's overlap
+int getHopSize(const SESSION_CONFIG* config)
+{
+    return (config->fftSize - (int)(config->fftSize * config->overlapPct / 100.0f));
+}
+
+// Sets up a frame assembler for frames of size samples, hop samples apart.
+// data must hold 2 * size floats.
+void frameAssemblerInit(FRAME_ASSEMBLER* frames, float* data, int size, int hop)
+{
+    frames->data    = data;
+    frames->size    = size;
+    frames->hop     = hop;
+    frames->head    = 0;
+    frames->filled  = 0;
+}
+
+// Adds samples to the assembler. Only the new samples are stored - the rest
+// of the frame stays where it is.
+void frameAssemblerPush(FRAME_ASSEMBLER* frames, const float* samples, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        frames->data[frames->head] = samples[i];
+        frames->data[frames->head + frames->size] = samples[i];
+        
+        if (++frames->head == frames->size)
+        {
+            frames->head = 0;
+        }
+    }
+    
+    frames->filled = (frames->filled + len < frames->size) ? frames->filled + len : frames->size;
+}
+
+// Gets the latest frame (the last size samples pushed), oldest sample
+// first. Only valid until more samples are pushed.
+const float* frameAssemblerFrame(const FRAME_ASSEMBLER* frames)
+{
+    return (frames->data + frames->head);
+}
+
+// Sets up the ring buffer that carries live samples from the PortAudio
+// callback to the analysis loop. The size is rounded up to a power of two
+// so positions can be wrapped with a mask.
+void ringInit(RING_BUFFER* ring, size_t minCapacity)
+{
+    size_t size = 1;
+    
+    while (size < minCapacity)
+    {
+        size <<= 1;
+    }
+    
+    ring->data = (float*)malloc(sizeof(float) * size);
+    ring->size = size;
+    
+    atomic_init(&ring->writePos, 0);
+    atomic_init(&ring->readPos, 0);
+    atomic_init(&ring->dropped, 0);
+}
+
+void ringFree(RING_BUFFER* ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+// PRODUCER ONLY. Copies in as many samples as there is room for and returns
+// how many were written. Never blocks or takes a lock, so it is safe to call
+// from the PortAudio callback.
+size_t ringWrite(RING_BUFFER* ring, const float* samples, size_t len)
+{
+    size_t writePos = atomic_load_explicit(&ring->writePos, memory_order_relaxed);
+    size_t readPos  = atomic_load_explicit(&ring->readPos, memory_order_acquire);
+    
+    size_t space = ring->size - (writePos - readPos);
+    
+    if (len > space)
+    {
+        len = space;
+    }
+    
+    // Copy in up to two parts, in case the write wraps around the end
+    size_t start    = writePos & (ring->size - 1);
+    size_t first    = (len < ring->size - start) ? len : ring->size - start;
+    
+    memcpy(ring->data + start, samples, first * sizeof(float));
+    memcpy(ring->data, samples + first, (len - first) * sizeof(float));
+    
+    // Publish the samples to the consumer
+    atomic_store_explicit(&ring->writePos, writePos + len, memory_order_release);
+    
+    return (len);
+}
+
+// CONSUMER ONLY. Copies out up to len samples that are waiting and returns
+// how many were read.
+size_t ringRead(RING_BUFFER* ring, float* samples, size_t len)
+{
+    size_t readPos  = atomic_load_explicit(&ring->readPos, memory_order_relaxed);
+    size_t writePos = atomic_load_explicit(&ring->writePos, memory_order_acquire);
+    
+    size_t waiting = writePos - readPos;
+    
+    if (len > waiting)
+    {
+        len = waiting;
+    }
+    
+    size_t start    = readPos & (ring->size - 1);
+    size_t first    = (len < ring->size - start) ? len : ring->size - start;
+    
+    memcpy(samples, ring->data + start, first * sizeof(float));
+    memcpy(samples + first, ring->data, (len - first) * sizeof(float));
+    
+    // Hand the space back to the producer
+    atomic_store_explicit(&ring->readPos, readPos + len, memory_order_release);
+    
+    return (len);
+}
+
+// PortAudio callback for recordings. Runs on PortAudio's audio thread, so all
+// it does is push the captured block into the ring buffer - writing the .wav
+// and the analysis happen on the record() thread.
+int captureCallback(const void* input, void* output, unsigned long frameCount,
+                    const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags,
+                    void* userData)
+{
+    RING_BUFFER* ring = (RING_BUFFER*)userData;
+    
+    if (input != NULL)
+    {
+        size_t written = ringWrite(ring, (const float*)input, frameCount);
+        
+        // Analysis has fallen more than RING_SECONDS behind - samples are lost
+        if (written < frameCount)
+        {
+            atomic_fetch_add_explicit(&ring->dropped, frameCount - written, memory_order_relaxed);
+        }
+    }
+    
+    return (paContinue);
+}
+
+// Takes the next len samples of the live recording from the ring buffer,
+// waiting for the callback to capture them, and archives them to the .wav.
+// Returns fewer than len only once the user has stopped recording and
+// everything captured has been read.
+int captureRead(LIVE_CAPTURE* live, float* samples, int len)
+{
+    int read = 0;
+    
+    while (read < len)
+    {
+        read += ringRead(&live->ring, samples + read, len - read);
+        
+        if (read < len)
+        {
+            if (live->stopped)
+            {
+                break; // Fully drained
+            }
+            else if (!atomic_load(live->running))
+            {
+                // User has pressed Stop. Once the stream has stopped no more
+                // callbacks will run, so whatever is left in the buffer is
+                // the end of the recording.
+                PaError err = Pa_StopStream(live->stream);
+                checkError(err);
+                
+                live->stopped = true;
+                
+                printf("\nSample collection stopped.\n");
+            }
+            else
+            {
+                // Wait for more audio to be captured
+                Pa_Sleep(CAPTURE_POLL_MS);
+            }
+        }
+    }
+    
+    if (read > 0)
+    {
+        // Write samples to a .wav to keep a copy of the recording
+        tinywav_write_f(live->tw, samples, read);
+    }
+    
+    return (read);
+}
+
+// Reads enough of the live recording for the next frame - a whole frame to
+// start with, then one hop - and adds it to the frame assembler, decimated
+// and low-pass filtered (see conditionSamples()). samples must hold the
+// frame's samples before decimation. Returns false once the recording has
+// stopped and there isn't enough left.
+bool readFrame(LIVE_CAPTURE* live, FRAME_ASSEMBLER* frames, float* samples, DECIMATOR* dec, LOW_PASS_FILTER* filter)
+{
+    int len = (frames->filled < frames->size) ? frames->size - frames->filled : frames->hop;
+    int read = captureRead(live, samples, len * dec->factor);
+    
+    if (read != len * dec->factor)
+    {
+        return (false);
+    }
+    
+    conditionSamples(dec, filter, samples, read, samples, frames->filled == 0);
+    frameAssemblerPush(frames, samples, len);
+    
+    return (true);
+}
+
+// Reads len samples of the upload, starting at sample pos, and decimates and
+// low-pass filters them into output (see conditionSamples()). Mono float
+// .wavs are read straight from the mapping - anything else is converted
+// first, into samples if decimating (len floats), otherwise into output.
+// Returns the number of samples written to output.
+int readUploadSamples(const TinyWavMap* map, int pos, int len, float* samples, float* output,
+                      DECIMATOR* dec, LOW_PASS_FILTER* filter)
+{
+    const float* input = NULL;
+    
+    if (map->numChannels == CHANNELS)
+    {
+        input = tinywav_map_frames_f(map, pos);
+    }
+    
+    if (input == NULL)
+    {
+        float* converted = (dec->factor > 1) ? samples : output;
+        
+        len = tinywav_map_read_f(map, pos, converted, len, 0);
+        input = converted;
+    }
+    
+    if (len <= 0)
+    {
+        return (0);
+    }
+    
+    return (conditionSamples(dec, filter, input, len, output, pos == 0));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Analysis buffers
+//
+// All of a session's working buffers are carved out of one 64-byte aligned
+// arena, allocated once when the session starts. This keeps them off the
+// stack (at 65536 points a single frame is 256 KB) and avoids allocating
+// anything per frame.
+
+// Sets up an arena of size bytes. An arena with no memory (base == NULL)
+// can be used to measure how much a set of buffers needs - see
+// allocAnalysisBuffers().
+bool arenaInit(ARENA* arena, size_t size)
+{
+    arena->base = NULL;
+    arena->size = ARENA_ROUND(size);
+    arena->used = 0;
+    
+    if (arena->size > 0)
+    {
+        arena->base = (char*)aligned_alloc(ARENA_ALIGN, arena->size);
+    }
+    
+    return (arena->size == 0 || arena->base != NULL);
+}
+
+// Takes the next block of bytes from the arena, 64-byte aligned. If the arena
+// has no memory, it only counts the space and returns NULL.
+void* arenaAlloc(ARENA* arena, size_t bytes)
+{
+    void* ptr = NULL;
+    
+    if (arena->base != NULL)
+    {
+        if (arena->used + ARENA_ROUND(bytes) > arena->size)
+        {
+            return (NULL);
+        }
+        
+        ptr = arena->base + arena->used;
+    }
+    
+    arena->used += ARENA_ROUND(bytes);
+    
+    return (ptr);
+}
+
+void arenaFree(ARENA* arena)
+{
+    free(arena->base);
+    
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
+
+// Floats of HPS working space needed per thread - the HPS output itself
+// and the squared magnitude spectrum
+int getHpsScratchLen(int numBins)
+{
+    return (getArrayLen(numBins, MIN_HARMONICS) + numBins);
+}
+
+// Carves the buffers for a session out of the arena. Called once on an empty
+// arena to measure the total size, then again to hand out the memory.
+void carveAnalysisBuffers(ARENA* arena, ANALYSIS_BUFFERS* bufs, const SESSION_CONFIG* config, int blockFrames, int factor)
+{
+    int fftSize = config->fftSize;
+    int stride = getSpectrumStride(fftSize);
+    
+    bufs->blockFrames   = blockFrames;
+    bufs->scratchLen    = ARENA_ROUND(getHpsScratchLen(NUM_BINS(fftSize)) * sizeof(float)) / sizeof(float);
+    
+    bufs->samples       = (float*)arenaAlloc(arena, sizeof(float) * fftSize * factor);
+    bufs->decimatorMem  = (float*)arenaAlloc(arena, sizeof(float) * getDecimatorMemLen(factor));
+    bufs->frameRing     = (float*)arenaAlloc(arena, sizeof(float) * fftSize * 2);
+    bufs->streamLen     = (blockFrames - 1) * getHopSize(config) + fftSize;
+    bufs->stream        = (float*)arenaAlloc(arena, sizeof(float) * bufs->streamLen);
+    
+    bufs->frameSrc      = (const float**)arenaAlloc(arena, sizeof(float*) * blockFrames);
+    bufs->inp           = (float*)arenaAlloc(arena, sizeof(float) * fftSize * blockFrames);
+    bufs->outp          = (fftwf_complex*)arenaAlloc(arena, sizeof(fftwf_complex) * stride * blockFrames);
+    bufs->polarData     = (float*)arenaAlloc(arena, sizeof(float) * fftSize * blockFrames);
+    bufs->features      = (FRAME_FEATURES*)arenaAlloc(arena, sizeof(FRAME_FEATURES) * blockFrames);
+    
+    bufs->odsData       = (float*)arenaAlloc(arena, onsetsds_memneeded(ODS_ODF_RCOMPLEX, fftSize, MEDIAN_SPAN));
+    bufs->threadScratch = (float*)arenaAlloc(arena, sizeof(float) * bufs->scratchLen * config->numThreads);
+    
+    bufs->midiTrack     = (unsigned char*)arenaAlloc(arena, MIDI_TRACK_MEM);
+}
+
+// Allocates all working buffers for a session at its FFT size, for blocks of
+// blockFrames frames analysed by up to its number of threads, with the stream
+// decimated by factor.
+bool allocAnalysisBuffers(ARENA* arena, ANALYSIS_BUFFERS* bufs, const SESSION_CONFIG* config, int blockFrames, int factor)
+{
+    // Measure...
+    arenaInit(arena, 0);
+    carveAnalysisBuffers(arena, bufs, config, blockFrames, factor);
+    
+    // ...then allocate
+    if (!arenaInit(arena, arena->used))
+    {
+        return (false);
+    }
+    
+    carveAnalysisBuffers(arena, bufs, config, blockFrames, factor);
+    
+    for (int k = 0; k < blockFrames; k++)
+    {
+        bufs->features[k].polar = (OdsPolarBuf*)(bufs->polarData + k * config->fftSize);
+    }
+    
+    return (true);
+}
+
+// Gets the HPS working space for the calling thread
+float* getThreadScratch(ANALYSIS_BUFFERS* bufs)
+{
+    int thread = 0;
+    
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    
+    return (bufs->threadScratch + thread * bufs->scratchLen);
+}
+
+/* Analyses a block of collected frames, in two phases:
+*
+* 1. Everything that only depends on the (already filtered) frame itself -
+*    window, FFT, polar spectrum for the onset detector, HPS and peak search.
+*    The block is shared out between the session's threads, FFT_BLOCK_FRAMES
+*    frames at a time, with each full FFT_BLOCK_FRAMES transformed by one
+*    batched plan.
+* 2. Onset detection and note tracking, which carry state from one frame to
+*    the next, so are run over the frames in order on this thread.
+*/
+void analyseBlock(SESSION* session, fftwf_plan blockPlan, fftwf_plan framePlan, ANALYSIS_BUFFERS* bufs, int count, OnsetsDS* ods)
+{
+    const SESSION_CONFIG* config = &session->config;
+    int             fftSize     = config->fftSize;
+    int             harmonics   = session->numHarmonics;
+    int             threads     = config->numThreads;
+    float           binSize     = session->analysisRate / (float)fftSize;
+    
+    float*          inp         = bufs->inp;
+    fftwf_complex*  outp        = bufs->outp;
+    FRAME_FEATURES* features    = bufs->features;
+    
+    int stride = getSpectrumStride(fftSize);
+    int numSubBlocks = (count + FFT_BLOCK_FRAMES - 1) / FFT_BLOCK_FRAMES;
+    
+    // Get new array size for downsampled data - the chosen number of harmonics considered
+    int dsSize = getArrayLen(NUM_BINS(fftSize), harmonics);
+    
+    // Bins that can hold a note, and the part of the spectrum they need
+    BIN_RANGE range = getPeakBinRange(NUM_BINS(fftSize), harmonics, binSize);
+    
+    #pragma omp parallel for schedule(dynamic) if (numSubBlocks > 1 && threads > 1) num_threads(threads)
+    for (int b = 0; b < numSubBlocks; b++)
+    {
+        int first   = b * FFT_BLOCK_FRAMES;
+        int last    = (first + FFT_BLOCK_FRAMES < count) ? first + FFT_BLOCK_FRAMES : count;
+        
+        // This thread's working space - HPS output, then the magnitude spectrum
+        float* dsResult = getThreadScratch(bufs);
+        float* hpsScratch = dsResult + dsSize;
+        
+        /*Apply windowing function (Hann by default)
+        * ------------------------------------------
+        * Reduces spectral leakage.
+        * The FFT expects a finite, periodic signal with an integer number of
+        * periods to analyse.
+        *
+        * Realistically this may not be the case on the segment of data analysed,
+        * as the data is segmented by the frame size and may not be cut off evenly.
+        * This is how spectral leakage occurs.
+        *
+        * The waveform we get likely won't be periodic and will be a non-continuous
+        * signal due to the above, so to circumvent this we apply a windowing function
+        * to reduce the amplitude of the discontinuities in the waveform (the edges).
+        * 
+        * This is also then why we use overlapping windows - to mitigate the loss
+        * of data at the edges of the window, and retain as much of the original time signal
+        * as possible.
+        *
+        * The windowed frames go straight into the FFT input (see
+        * preprocessFrames()).
+        */
+        preprocessFrames(bufs->frameSrc + first, inp + first * fftSize, last - first,
+                         bufs->window, fftSize);
+        
+        // Carry out the FFTs
+        if (last - first == FFT_BLOCK_FRAMES)
+        {
+            fftwf_execute_dft_r2c(blockPlan, inp + first * fftSize, outp + first * stride);
+        }
+        else
+        {
+            for (int k = first; k < last; k++)
+            {
+                fftwf_execute_dft_r2c(framePlan, inp + k * fftSize, outp + k * stride);
+            }
+        }
+        
+        for (int k = first; k < last; k++)
+        {
+            fftwf_complex* spectrum = outp + k * stride;
+            
+            // Polar form of the spectrum for the onset detector
+            onsetsds_loadframe_into(ods, (float*)spectrum, features[k].polar);
+            
+            // Get HPS
+            harmonicProductSpectrum(spectrum, dsResult, &range, hpsScratch, harmonics, threads);
+            
+            // Find peak
+            features[k].peakFreq = hps_findPeak(dsResult, &range, binSize, &features[k].peakAmp);
+        }
+    }
+    
+    for (int k = 0; k < count; k++)
+    {
+        // Carry out onset detection from FFT output, using a complex-domain deviation
+        // onset detection function
+        bool onset = onsetsds_process_polar(ods, features[k].polar);
+        
+        // Track notes from the peaks
+        trackNote(session, features[k].peakFreq, features[k].peakAmp, onset);
+    }
+}
+
+// Main function for processing microphone data - transcribes the session's
+// recording or upload to its .mid file. Uses nothing but the session and the
+// shared plans and tables, so sessions can run at once on different threads.
+// Returns 1 on success, 0 if the audio couldn't be read or analysed.
+int record(SESSION* session)
+{
+    const SESSION_CONFIG* config = &session->config;
+    int fftSize = config->fftSize;
+    
+    // All working buffers for the session (see allocAnalysisBuffers()):
+    //
+    // - The samples just read, and the filtered samples the frames are
+    //   taken from - a ring for recordings (see FRAME_ASSEMBLER), or a run
+    //   covering a block of frames for uploads.
+    // - FFTW3 input and output arrays. The samples are real, so a
+    //   real-to-complex FFT is used - the output is only the non-redundant
+    //   half of the spectrum (bins 0 to N/2), as the other half is just its
+    //   complex conjugate. Each array holds a block of frames, which are
+    //   collected first and then analysed together (see analyseBlock()).
+    // - Per frame results of the parallel stages.
+    ARENA               arena;
+    ANALYSIS_BUFFERS    bufs;
+    
+    fftwf_plan       blockPlan; // Contains all data needed for computing FFT
+    fftwf_plan       framePlan;
+
+    // The uploaded .wav, mapped into memory so its frames can be analysed
+    // where they lie
+    TinyWavMap map;
+    
+    // For writing the user's recording to a .wav to keep a copy
+    TinyWav tw;
+
+    // OnsetsDS struct - onset detection
+    OnsetsDS ods;
+    
+    // Live recording - the PortAudio callback passes samples to the
+    // analysis loop below through a ring buffer as they are recorded
+    PaStream*       pStream     = NULL;
+    LIVE_CAPTURE    capture;
+    LIVE_CAPTURE*   live        = NULL;
+    
+    // Overlapping frames of the recording, built as it comes in
+    FRAME_ASSEMBLER frames;
+    
+    // Samples between the starts of successive frames
+    int hop = getHopSize(config);
+    
+    // Low-pass filter, run over all the samples as they're read - after
+    // the decimator, if decimating
+    DECIMATOR       decimator;
+    LOW_PASS_FILTER lowPass;
+    
+    // Sample rate of the audio - recordings are captured at SAMPLE_RATE,
+    // uploads are read at their own rate. The upload is mapped first, as its
+    // rate decides everything else.
+    int inputRate = SAMPLE_RATE;
+    
+    if (!session->isRecording)
+    {
+        if (tinywav_map_open(&map, session->wavUploadLoc) != 0)
+        {
+            printf("\n[!] ERROR: Could not read %s\n", session->wavUploadLoc);
+            atomic_store(&session->running, false);
+            return (0);
+        }
+        
+        if (map.h.SampleRate < MIN_SAMPLE_RATE || map.h.SampleRate > MAX_SAMPLE_RATE)
+        {
+            printf("\n[!] ERROR: Unsupported sample rate (%u Hz) in %s\n", map.h.SampleRate, session->wavUploadLoc);
+            tinywav_map_close(&map);
+            atomic_store(&session->running, false);
+            return (0);
+        }
+        
+        // Only 16-bit PCM and 32-bit float samples can be read
+        if (!(map.h.AudioFormat == 1 && map.h.BitsPerSample == 16) && !(map.h.AudioFormat == 3 && map.h.BitsPerSample == 32))
+        {
+            printf("\n[!] ERROR: Unsupported sample format (%u-bit, format %u) in %s\n", map.h.BitsPerSample, map.h.AudioFormat, session->wavUploadLoc);
+            tinywav_map_close(&map);
+            atomic_store(&session->running, false);
+            return (0);
+        }
+        
+        inputRate = map.h.SampleRate;
+    }
+    
+    // Frames are analysed at the decimated rate - set before anything that
+    // depends on it (bin sizes, filter coefficients)
+    int factor = config->decimation * getRateFactor(inputRate);
+    
+    session->analysisRate = (float)inputRate / (float)factor;
+    
+    // Decimating too far leaves too little spectrum for the chosen harmonics,
+    // which would turn notes into octave errors - fewer are used instead
+    session->numHarmonics = getMaxHarmonics(session->analysisRate);
+    
+    if (session->numHarmonics > config->numHarmonics)
+    {
+        session->numHarmonics = config->numHarmonics;
+    }
+    
+    if (session->numHarmonics < MIN_HARMONICS)
+    {
+        printf("\n[!] ERROR: Decimating by %d leaves too little spectrum (up to %.0f Hz) for the harmonic product spectrum\n",
+               factor, session->analysisRate / 2.0f);
+        
+        if (!session->isRecording)
+        {
+            tinywav_map_close(&map);
+        }
+        
+        atomic_store(&session->running, false);
+        return (0);
+    }
+    
+    // An upload is already on disk, so its frames are analysed a block at a
+    // time, with the block shared out between the session's threads. A
+    // recording is analysed frame by frame, as soon as each one is captured.
+    int blockFrames = session->isRecording ? 1 : FFT_BLOCK_FRAMES * config->numThreads * PARALLEL_BLOCKS;
+    int blockCount  = 0;    // Frames collected in the current block
+    
+    if (blockFrames > 1 && blockFrames * fftSize > MAX_BLOCK_SAMPLES)
+    {
+        blockFrames = (MAX_BLOCK_SAMPLES / fftSize > FFT_BLOCK_FRAMES) ? MAX_BLOCK_SAMPLES / fftSize : FFT_BLOCK_FRAMES;
+    }
+    
+    if (!allocAnalysisBuffers(&arena, &bufs, config, blockFrames, factor) || getWindow(config->windowType, fftSize) == NULL)
+    {
+        printf("\n[!] ERROR: Not enough memory for an FFT size of %d\n", fftSize);
+        
+        arenaFree(&arena);
+        
+        if (!session->isRecording)
+        {
+            tinywav_map_close(&map);
+        }
+        
+        atomic_store(&session->running, false);
+        return (0);
+    }
+    
+    // 1D real DFTs of the frame size - built at startup
+    framePlan = getFftPlan(fftSize, 1);
+    blockPlan = getFftPlan(fftSize, FFT_BLOCK_FRAMES);
+    
+    // Allocate memory for ODS - onset detection.
+    // NOTE: the detector has always been given the FFT output in this
+    // (halfcomplex) mode, and its thresholds are tuned to that - the first
+    // fftSize floats of the real-to-complex output are the same as the
+    // old complex output, so detection is unchanged.
+    onsetsds_init(&ods, bufs.odsData, ODS_FFT_FFTW3_HC, ODS_ODF_RCOMPLEX, fftSize, MEDIAN_SPAN, session->analysisRate);
+    
+    // Prepare window and filters
+    bufs.window = getWindow(config->windowType, fftSize);
+    decimatorInit(&decimator, factor, bufs.decimatorMem);
+    filterInit(&lowPass, config->lowPassOrder, MAX_FREQUENCY, session->numHarmonics, session->analysisRate);
+    
+#ifdef _OPENMP
+    // Thread count is per thread in OpenMP, so is set on this (the analysing)
+    // thread - used by the onset detector's per-bin loops
+    omp_set_num_threads(config->numThreads);
+#endif
+    
+    // This will store the total number of samples analysed
+    int totalSamples = 0;
+    
+    int numFrames = 0;  // Number of times samples are collected
+                        // (total number of frames processed)
+
     // If we're RECORDING, open a PortAudio stream to capture user audio data
-    if (!isUpload && newRecording)
+    if (session->isRecording)
     {
         // Initialise PortAudio stream
         PaError err = Pa_Initialize();
@@ -1193,12 +2835,16 @@ void* record(void* args)
         if (numDevices < 0)
         {
             printf("Error getting the device count\n");
-            exit(-1);
+            arenaFree(&arena);
+            atomic_store(&session->running, false);
+            return (0);
         }
         else if (numDevices == 0)
         {
             printf("No available audio devices detected!\n");
-            exit(-1);
+            arenaFree(&arena);
+            atomic_store(&session->running, false);
+            return (0);
         }
 
         // Devices found - display info
@@ -1223,35 +2869,33 @@ void* record(void* args)
         if (inpDevice == paNoDevice)
         {
             printf("No default input device.\n");
-            exit(-1);
+            arenaFree(&arena);
+            atomic_store(&session->running, false);
+            return (0);
         }
 
         // Configure input params for PortAudio stream
         configureInParams(inpDevice, &inputParams);
         
+        // The ring buffer holds up to RING_SECONDS of audio in case the
+        // analysis briefly falls behind
+        ringInit(&capture.ring, SAMPLE_RATE * RING_SECONDS);
+        
         // Open PortAudio stream
         printf("Opening stream\n");
-        PaStream* pStream;
         err = Pa_OpenStream
         (
             &pStream,
             &inputParams,
             NULL, // Output parameters - not outputting data, so set to null
             SAMPLE_RATE,
-            WINDOW_SIZE,
+            paFramesPerBufferUnspecified, // Let PortAudio pick the block size - the
+                                          // analysis assembles its own frames
             paClipOff, // Not outputting out of range samples, don't clip
-            NULL, // No callback function, so null
-            NULL // No user data here, is processed instead below, so null
+            captureCallback,
+            &capture.ring
         );
         checkError(err);
-
-        printf("Starting stream\n");
-        err = Pa_StartStream(pStream);
-        checkError(err);
-
-        printf("--- Recording... ---\n");
-
-        // --- Main recording loop ---
         
         // Open .wav file to write to
         tinywav_open_write(&tw,
@@ -1259,33 +2903,19 @@ void* record(void* args)
                             SAMPLE_RATE,
                             TW_FLOAT32,
                             TW_INLINE,  
-                            wavOutputLoc);
-        
-        while (running)
-        {
-            // Read samples from microphone.
-            err = Pa_ReadStream(pStream, samples, WINDOW_SIZE);
-            checkError(err);
-            
-            // Write samples to a .wav for FFT/other processing afterwards
-            tinywav_write_f(&tw, samples, WINDOW_SIZE);
-            
-            numFrames++;
-        }
-        
-        tinywav_close_write(&tw);
+                            session->wavOutputLoc);
         
-        printf("\nSample collection stopped.\n");
+        capture.stream  = pStream;
+        capture.tw      = &tw;
+        capture.stopped = false;
+        capture.running = &session->running;
+        live            = &capture;
 
-        err = Pa_StopStream(pStream);
-        checkError(err);
-
-        err = Pa_CloseStream(pStream);
+        printf("Starting stream\n");
+        err = Pa_StartStream(pStream);
         checkError(err);
         
-        pStream = NULL;
-        
-        printf("Stream closed.\n");
+        printf("--- Recording... ---\n");
     }
 
     
@@ -1295,15 +2925,19 @@ void* record(void* args)
      * PROCESSING THE AUDIO DATA
      * -------------------------
      * 
-     * 1.  Read in the .wav file the user just recorded.
-     * 2.  Acquire set of FP samples - overlapping by 50%.
+     * 1.  Read in the samples - as they are recorded, or from
+     *     the uploaded .wav file.
+     * 2.  Acquire set of FP samples - overlapping the last
+     *     set by the overlap (25% to 87.5%, 50% by default).
      *     This reduces data loss from windowing (step 4).
      * 3.  Low pass the data to help filter out higher 
-     *     frequencies.
-     * 4.  Apply a Hann window to the data. This helps to
+     *     frequencies (decimating it first, if chosen).
+     * 4.  Apply a window (Hann by default) to the data. This helps to
      *     reduce spectral leakage.
-     * 5.  Format the data into complex numbers for the FFT.
-     * 6.  Carry out the FFT to acquire frequency data.
+     * 5.  (Filtered and windowed samples are written straight
+     *     into the FFT input.)
+     * 6.  Carry out the real-to-complex FFT to acquire
+     *     frequency data (bins 0 to fftSize/2).
      * 7.  Downsample and apply harmonic product spectrum for
      *     a better fundamental frequency estimate.
      * 8.  Calculate any onsets (from raw FFT output)
@@ -1318,131 +2952,57 @@ void* record(void* args)
      *    
      ********************************************************/
     
-    if (isUpload && !newRecording)
+    if (live == NULL)
     {
-        printf("\n||| This is an UPLOAD |||\n");
-        
-        // Get size of the file in bytes for calculating the total number
-        // of frames
-        struct stat st;
-        stat(wavUploadLoc, &st);
-        int size = st.st_size;
-        
-        tinywav_open_read(&tw, wavUploadLoc, TW_SPLIT);
-        
-        // Get the number of individual frames, as we don't have this information
-        // from recording it here
-        numFrames = (size / (tw.h.NumChannels * tw.h.BitsPerSample / 8)) / WINDOW_SIZE;
+        printf("\n||| This is an UPLOAD (%d Hz, analysed at %.1f Hz) |||\n", inputRate, session->analysisRate);
+        printf("\n*** Starting sample analysis (num frames = %d) ***\n", map.numFrames / factor / fftSize);
     }
     else
     {
         printf("\n||| This is a RECORDING |||\n");
-        // Read from .wav file and carry out all processing.
-        // Number of frames already calculated during recording process
-        tinywav_open_read(&tw, wavOutputLoc, TW_SPLIT);
+        printf("\n*** Starting sample analysis (live) ***\n");
     }
     
-    totalSamples = numFrames * WINDOW_SIZE;
-    
-    // Duration of the recording is equal to the total number of
-    // samples, divided by the sample rate
-    float timeSecs = (float)totalSamples / (float)SAMPLE_RATE;
+    // Amount of time each frame accounts for - the time until the next
+    // frame starts
+    float frameTime = (float)hop / session->analysisRate;
     
-    // Amount of time each frame accounts for
-    float frameTime = timeSecs / numFrames;
-
-    printf("\n*** Starting sample analysis (num frames = %d) ***\n", numFrames);
-
-    int iterations = 0;
-
-    // Loop through all of the samples, frame by frame
-    for (int i = 0; i < numFrames; i++)
+    // Notes are written to the MIDI file as they're found
+    if (!midiOutputOpen(session, frameTime, bufs.midiTrack, MIDI_TRACK_MEM))
     {
-        // Set up pointers to samples, separated by channels
-        // (only one in our case however)
-        float* samplePtrs[CHANNELS];
-        float* nextSamplePtrs[CHANNELS];
-        
-        for (int j = 0; j < CHANNELS; ++j)
-        {
-            if (firstRun)
-            {
-                samplePtrs[j] = samples + j * WINDOW_SIZE;
-            }
-            if (i < numFrames - 1)
-            {
-                nextSamplePtrs[j] = nextSamples + j * WINDOW_SIZE;
-            }            
-        }
-
-        if (firstRun)
-        {
-            // Read twice on the first run - once for the samples this cycle,
-            // again for the next cycle's samples for overlapping
-            tinywav_read_f(&tw, samplePtrs, WINDOW_SIZE);
-            tinywav_read_f(&tw, nextSamplePtrs, WINDOW_SIZE);
-            // Copy next set of samples to be used on the next cycle
-            memcpy(savedNextSamples, nextSamples, sizeof(savedNextSamples));
-
-            // Iterations = 2. First we process the samples normally (N -> N + WINDOW_SIZE),
-            // then again for the overlapped samples in between (at a 50% overlap).
-            //
-            // This entails taking the second half of our current samples and combining
-            // them with the first half of the next
-            iterations = 2;
-        }
-        // Else if not the last run
-        else if (i < numFrames - 1)
-        {
-            // Copy previously acquired samples for this cycle to "current" samples array
-            memcpy(samples, savedNextSamples, sizeof(samples));
-
-            tinywav_read_f(&tw, nextSamplePtrs, WINDOW_SIZE);
-
-            // Copy next acquired samples to be used on the next cycle
-            memcpy(savedNextSamples, nextSamples, sizeof(savedNextSamples));
-
-            iterations = 2;
-        }
-        // Last run
-        else
-        {
-            // Copy previously acquired samples for this cycle to "current" samples array
-            memcpy(samples, savedNextSamples, sizeof(samples));
-
-            memset(nextSamples, 0, sizeof(nextSamples));
+        // If MIDI file creation fails
+        printf("\n[!] ERROR: Failed to create MIDI file.\n");
+    }
 
-            // Iterations = 1. For the last sample we have, just process it normally (no overlapping)
-            iterations = 1;
-        }
+    /*Overlap the windows
+    * --------------------
+    * Each frame starts hop samples after the last, so successive frames
+    * share (fftSize - hop) samples. This reduces potential data loss
+    * brought about by windowing - more overlap gives better time
+    * resolution, at the cost of more frames to analyse.
+    */
+    if (live == NULL)
+    {
+        int streamStart = 0;    // Position in the upload of bufs.stream[0]
+        int streamEnd   = 0;    // Samples filtered so far
         
-        /*Overlap the window
-        * ------------------
-        * Use a 50% overlap by taking the latter half of the samples
-        * from the previous window, and combining it with the first 
-        * half of the new window of samples to reduce potential data 
-        * loss brought about by windowing.
-        */
+        // Positions are at the analysis rate - the upload's samples before
+        // decimation are factor times further in
+        int streamLimit = map.numFrames / factor;
         
-        // Save the second half of the samples to be used in the next FFT
-        // cycle for overlapping
-        saveOverlappedSamples(samples, overlapPrev, WINDOW_SIZE);
-
-        for (int j = 0; j < iterations; j++)
+        // The whole upload is already in memory, so the frames are simply the
+        // spans of (filtered) samples they cover. Stops early if the session
+        // is stopped.
+        for (int pos = 0; pos + fftSize <= streamLimit && atomic_load_explicit(&session->running, memory_order_relaxed); pos += hop)
         {
-            if (j == 0)
-            {
-                // If on one iteration, process samples normally by just
-                // copying them as is into newSamples
-                memcpy(newSamples, samples, sizeof(newSamples));
-            }
-            else
+            // Each block starts at the front of the stream buffer, keeping
+            // what's already been filtered of its first frame
+            if (blockCount == 0)
             {
-                // If doing a second iteration for overlapped samples, carry out
-                // the overlap (50% of current samples, 50% of next) and process
-                overlapWindow(nextSamples, overlapPrev, newSamples, WINDOW_SIZE);
+                memmove(bufs.stream, bufs.stream + (pos - streamStart), sizeof(float) * (streamEnd - pos));
+                streamStart = pos;
             }
-
+            
             /*Low-pass the data
             * -----------------
             * Remove unwanted/higher frequencies or noise from the sample
@@ -1450,74 +3010,118 @@ void* record(void* args)
             *
             * Limit the range to three octaves from C3-C6, so a frequency
             * range of 130.8 Hz - 1108.73 Hz
-            */
-            lowPassData(newSamples, lowPassedSamples, WINDOW_SIZE, MAX_FREQUENCY);
-
-            /*Apply windowing function (Hann)
-            * -------------------------------
-            * Reduces spectral leakage.
-            * The FFT expects a finite, periodic signal with an integer number of
-            * periods to analyse.
             *
-            * Realistically this may not be the case on the segment of data analysed,
-            * as the data is segmented by WINDOW_SIZE and may not be cut off evenly.
-            * This is how spectral leakage occurs.
-            *
-            * The waveform we get likely won't be periodic and will be a non-continuous
-            * signal due to the above, so to circumvent this we apply a windowing function
-            * to reduce the amplitude of the discontinuities in the waveform (the edges).
-            * 
-            * This is also then why we use overlapping windows (at 50%) - to mitigate the loss
-            * of data at the edges of the window, and retain as much of the original time signal
-            * as possible.
+            * The samples are filtered once each, as a stream, as the frame
+            * that first needs them is reached.
             */
-            setWindow(window, lowPassedSamples, WINDOW_SIZE);
-
-            // Convert to FFTW3 complex array
-            convertToComplexArray(lowPassedSamples, inp, WINDOW_SIZE);
-
-            // Carry out the FFT
-            fftwf_execute(plan);
-
-            // Get new array size for downsampled data - 5 harmonics considered
-            dsSize = getArrayLen(WINDOW_SIZE, 5);
-            float dsResult[dsSize];
-
-            // Carry out onset detection from FFT output, using a complex-domain deviation
-            // onset detection function
-            onset = onsetsds_process(&ods, outp);
-
-            // Get HPS
-            harmonicProductSpectrum(outp, dsResult, WINDOW_SIZE);
+            streamEnd += readUploadSamples(&map, streamEnd * factor, (pos + fftSize - streamEnd) * factor,
+                                           bufs.samples, bufs.stream + (streamEnd - streamStart),
+                                           &decimator, &lowPass);
+            
+            bufs.frameSrc[blockCount] = bufs.stream + (pos - streamStart);
+            numFrames++;
+            
+            if (++blockCount == blockFrames)
+            {
+                analyseBlock(session, blockPlan, framePlan, &bufs, blockCount, &ods);
+                blockCount = 0;
+            }
+        }
+    }
+    else
+    {
+        frameAssemblerInit(&frames, bufs.frameRing, fftSize, hop);
+        
+        // Loop through all of the recorded samples, a hop at a time, until
+        // the recording is stopped
+        while (readFrame(live, &frames, bufs.samples, &decimator, &lowPass))
+        {
+            const float* frame = frameAssemblerFrame(&frames);
+            
+            // A recording is analysed frame by frame (blockFrames = 1), so
+            // the frame can be read straight from the assembler. Anything
+            // held for longer is copied, as the next hop overwrites it.
+            if (blockFrames > 1)
+            {
+                float* frameIn = bufs.inp + blockCount * fftSize;
+                
+                memcpy(frameIn, frame, sizeof(float) * fftSize);
+                frame = frameIn;
+            }
+            
+            bufs.frameSrc[blockCount] = frame;
+            numFrames++;
 
-            // Find peaks
-            hps_getPeak(dsResult, dsSize, onset);
-        }       
+            /*Analyse the block
+            * -----------------
+            * Once the block is full, window its frames and carry out the
+            * FFTs, onset detection, HPS and peak search.
+            */
+            if (++blockCount == blockFrames)
+            {
+                analyseBlock(session, blockPlan, framePlan, &bufs, blockCount, &ods);
+                blockCount = 0;
+            }
+        }
+    }
+    
+    // Analyse any frames left over in the last block
+    if (blockCount > 0)
+    {
+        analyseBlock(session, blockPlan, framePlan, &bufs, blockCount, &ods);
+    }
+    
+    if (live != NULL)
+    {
+        // Stream has already been stopped by captureRead()
+        PaError err = Pa_CloseStream(pStream);
+        checkError(err);
+        
+        tinywav_close_write(&tw);
+        
+        size_t dropped = atomic_load(&capture.ring.dropped);
+        
+        if (dropped > 0)
+        {
+            printf("\n[!] WARNING: %zu samples were dropped - analysis fell behind\n", dropped);
+        }
+        
+        ringFree(&capture.ring);
+        
+        pStream = NULL;
+        
+        printf("Stream closed.\n");
+    }
+    else
+    {
+        printf("\n*** Closing .wav file ***\n");
+        tinywav_map_close(&map);
     }
     
-    printf("\n*** Closing .wav file ***\n");
-    tinywav_close_read(&tw);
+    totalSamples = (numFrames > 0) ? (numFrames - 1) * hop + fftSize : 0;
     
-    printf("\n(Each frame takes %f secs)\n", frameTime);
+    // Duration of the recording is equal to the total number of
+    // samples, divided by the sample rate
+    session->processedSecs = (float)totalSamples / session->analysisRate;
     
-    // Output to MIDI file
-    outputMidi(frameTime);
+    printf("\n(Each frame takes %f secs)\n", frameTime);
     
-    totalLen = 0;
-    bufIndex = 0;
+    // Finish the MIDI file
+    midiOutputClose(session);
     
-    fftwf_free(inp);
-    fftwf_free(outp);
+    noteStoreFree(&session->notes);
+    arenaFree(&arena);
     
     printf("\nMemory freed.\n");
     
-    pthread_mutex_lock(&procLock);
-    processing = 0; // Indicate to main (GTK) thread that processing has now stopped
-    pthread_mutex_unlock(&procLock);
+    atomic_store(&session->running, false);
     
     printf("\nLeaving record() function\n");
+    
+    return (1);
 }
 
+#ifndef HEADLESS
 // This function sets up the GUI and connects buttons to other functions.
 void activate(GtkApplication* app, gpointer data)
 {
@@ -1550,6 +3154,25 @@ void activate(GtkApplication* app, gpointer data)
     gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->fftSize), NULL, "2048");
     gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->fftSize), NULL, "4096");
     gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->fftSize), NULL, "8192");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->fftSize), NULL, "16384");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->fftSize), NULL, "32768");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->fftSize), NULL, "65536");
+    
+    // Set up frame overlap selection combo box - 50% unless changed
+    inputData->overlap = gtk_combo_box_text_new();
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->overlap), NULL, "25%");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->overlap), NULL, "50%");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->overlap), NULL, "75%");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->overlap), NULL, "87.5%");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(inputData->overlap), 1);
+    
+    // Set up window function selection combo box - Hann unless changed
+    inputData->window = gtk_combo_box_text_new();
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->window), NULL, "Hann");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->window), NULL, "Hamming");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->window), NULL, "Blackman-Harris");
+    gtk_combo_box_text_append(GTK_COMBO_BOX_TEXT(inputData->window), NULL, "Kaiser");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(inputData->window), 0);
 
     // Set up quantisation factor selection combo box
     inputData->quantisation = gtk_combo_box_text_new();
@@ -1570,6 +3193,8 @@ void activate(GtkApplication* app, gpointer data)
     GtkWidget* timeLbl          = gtk_label_new("Time signature (beats/bar): ");
     GtkWidget* timeDenomLbl     = gtk_label_new("Time signature (division): ");
     GtkWidget* fftSizeLbl       = gtk_label_new("FFT size: ");
+    GtkWidget* overlapLbl       = gtk_label_new("Window overlap: ");
+    GtkWidget* windowLbl        = gtk_label_new("Window function: ");
     GtkWidget* tempoLbl         = gtk_label_new("Tempo (BPM): ");
     GtkWidget* keyLbl           = gtk_label_new("Key signature: ");
     GtkWidget* fileLocLbl       = gtk_label_new("File output location: ");
@@ -1585,11 +3210,10 @@ void activate(GtkApplication* app, gpointer data)
     gtk_label_set_xalign(GTK_LABEL(fileLocLbl), 1.0);
     gtk_label_set_xalign(GTK_LABEL(inputData->msgLbl), 1.0);
     gtk_label_set_xalign(GTK_LABEL(fftSizeLbl), 1.0);
+    gtk_label_set_xalign(GTK_LABEL(overlapLbl), 1.0);
+    gtk_label_set_xalign(GTK_LABEL(windowLbl), 1.0);
     gtk_label_set_xalign(GTK_LABEL(quantiseLbl), 1.0);
     
-    // Set up the MIDI notes to correspond with list of pitches
-    setMidiNotes();
-    
     recBtn = gtk_button_new_with_label("Record");
     uploadBtn = gtk_button_new_with_label("Upload .wav");
 
@@ -1623,6 +3247,8 @@ void activate(GtkApplication* app, gpointer data)
     gtk_grid_attach(GTK_GRID(pGrid), fileLocLbl, 1, 5, 1, 1);
     gtk_grid_attach(GTK_GRID(pGrid), fftSizeLbl, 4, 2, 1, 1);
     gtk_grid_attach(GTK_GRID(pGrid), quantiseLbl, 4, 3, 1, 1);
+    gtk_grid_attach(GTK_GRID(pGrid), overlapLbl, 4, 4, 1, 1);
+    gtk_grid_attach(GTK_GRID(pGrid), windowLbl, 1, 4, 1, 1);
 
     gtk_grid_attach(GTK_GRID(pGrid), inputData->time, 2, 1, 1, 1);    
     gtk_grid_attach(GTK_GRID(pGrid), inputData->timeDenom, 5, 1, 1, 1);    
@@ -1632,6 +3258,8 @@ void activate(GtkApplication* app, gpointer data)
     gtk_grid_attach(GTK_GRID(pGrid), inputData->fileUpload, 3, 5, 1, 1);
     gtk_grid_attach(GTK_GRID(pGrid), inputData->quantisation, 5, 3, 1, 1);
     gtk_grid_attach(GTK_GRID(pGrid), inputData->fftSize, 5, 2, 1, 1);
+    gtk_grid_attach(GTK_GRID(pGrid), inputData->overlap, 5, 4, 1, 1);
+    gtk_grid_attach(GTK_GRID(pGrid), inputData->window, 2, 4, 1, 1);
 
     gtk_grid_attach(GTK_GRID(pGrid), recBtn, 2, 6, 1, 1);
     gtk_grid_attach(GTK_GRID(pGrid), uploadBtn, 3, 6, 1, 1);
@@ -1652,12 +3280,367 @@ int main(int argc, char** argv)
     GtkApplication* app;
     int result = 0;
 
+    // Only one recording/upload is analysed at a time, so it can use all cores
+    planThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    
+    // Build the FFT plans up front so the first recording doesn't wait for them
+    fftPlansInit();
+    preprocessInit();
+
     app = gtk_application_new("pitch.detection", G_APPLICATION_FLAGS_NONE);
     g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
     
     result = g_application_run(G_APPLICATION(app), argc, argv);
     
     g_object_unref(app);
+    
+    fftPlansCleanup();
+    windowsCleanup();
 
     return (result);
 }
+#else
+
+//////////////////////////////////////////////////////////////////////////////
+// Command-line batch mode (make p-cli)
+//
+// Each file is transcribed in a session of its own (see record()), so several
+// files are processed at once by a pool of threads, all sharing the FFT plans
+// and window tables.
+
+// Files waiting to be transcribed, taken in turn by the batch threads
+typedef struct
+{
+    const SESSION_CONFIG*   config;
+    char**                  wavFiles;
+    int                     numFiles;
+    const char*             outDir;
+    FILE*                   report;     // Where results are printed
+    
+    pthread_mutex_t         lock;       // Guards the fields below
+    int                     next;       // Next file to hand out
+    int                     failures;
+    double                  totalAudio;
+} BATCH_QUEUE;
+
+// Prints the command-line options
+void printUsage(const char* progName)
+{
+    fprintf(stderr,
+        "Usage: %s [options] file1.wav [file2.wav ...]\n"
+        "\n"
+        "  -t <bpm>       Tempo in BPM, 10-200 (default 120)\n"
+        "  -b <beats>     Time signature beats per bar, 2-16 (default 4)\n"
+        "  -d <division>  Time signature division: 2 (minims), 4 (crotchets) or 8 (quavers) (default 4)\n"
+        "  -k <key>       Key signature, e.g. \"Eb major\" (default \"C major\")\n"
+        "  -q <note>      Quantisation to a 1/n note: 1, 2, 4, 8 or 16 (default 4)\n"
+        "  -f <size>      FFT size: a power of two from 1024 to 65536 (default 2048)\n"
+        "  -H <harmonics> Harmonics used by the harmonic product spectrum, 2-8 (default 5)\n"
+        "  -w <window>    Window function: hann, hamming, blackman-harris or kaiser (default hann)\n"
+        "  -l <overlap>   Overlap between frames (%%): 25, 50, 75 or 87.5 (default 50)\n"
+        "  -p <order>     Low-pass filter order: 1 (single pole) or 2, 4, 6, 8 (Butterworth) (default 1)\n"
+        "  -a <Hz>        Tuning - the frequency of A4, 400-480 (default 440)\n"
+        "  -D <factor>    Decimate the audio by 1 (off), 2 or 4 before analysis - the same FFT size\n"
+        "                 then gives factor times finer frequency resolution, but -H is lowered to\n"
+        "                 4 (-D 2) or 2 (-D 4) if higher (default 1)\n"
+        "  -j <jobs>      Number of files to process in parallel (default: number of CPUs)\n"
+        "  -T <threads>   Threads used within each file (default 1)\n"
+        "  -o <dir>       Output directory for the .mid files (default: alongside each .wav)\n"
+        "  -v             Show the full analysis output for each file\n",
+        progName);
+}
+
+// Transcribes a single .wav file to a .mid file of the same name, with the
+// settings in config, timing how long it takes.
+int transcribeFile(const SESSION_CONFIG* config, const char* wavFile, const char* outDir, double* wallSecs, double* audioSecs)
+{
+    struct timespec start;
+    struct timespec end;
+    
+    char baseName[PATH_MAX];
+    
+    const char* fileName = strrchr(wavFile, '/');
+    fileName = (fileName == NULL) ? wavFile : fileName + 1;
+    
+    // Output is named after the .wav file, minus its extension
+    if (outDir != NULL)
+    {
+        snprintf(baseName, sizeof(baseName), "%s/%.*s", outDir, (int)strlen(fileName) - 4, fileName);
+    }
+    else
+    {
+        snprintf(baseName, sizeof(baseName), "%.*s", (int)strlen(wavFile) - 4, wavFile);
+    }
+    
+    SESSION session;
+    
+    sessionInit(&session, config);
+    
+    if (strlen(baseName) + 4 >= sizeof(session.fileOutputLoc) || strlen(wavFile) >= sizeof(session.wavUploadLoc))
+    {
+        printf("\n[!] ERROR: File path too long: %s\n", wavFile);
+        return (0);
+    }
+    
+    strcpy(session.fileOutputLoc, baseName);
+    strcat(session.fileOutputLoc, ".mid");
+    strcpy(session.wavUploadLoc, wavFile);
+    
+    // NOT a recording
+    session.isRecording = false;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int success = record(&session);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    (*wallSecs) = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    (*audioSecs) = session.processedSecs;
+    
+    return (success);
+}
+
+// Batch thread - transcribes files from the queue until there are none left
+void* batchWorker(void* args)
+{
+    BATCH_QUEUE* queue = (BATCH_QUEUE*)args;
+    
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+        int idx = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        
+        if (idx >= queue->numFiles)
+        {
+            break;
+        }
+        
+        double wallSecs = 0.0;
+        double audioSecs = 0.0;
+        
+        int success = transcribeFile(queue->config, queue->wavFiles[idx], queue->outDir, &wallSecs, &audioSecs);
+        
+        pthread_mutex_lock(&queue->lock);
+        
+        if (success)
+        {
+            fprintf(queue->report, "[%d/%d] %s: %.3f s for %.3f s of audio (RTF %.4f)\n",
+                idx + 1, queue->numFiles, queue->wavFiles[idx],
+                wallSecs, audioSecs,
+                audioSecs > 0.0 ? wallSecs / audioSecs : 0.0);
+            
+            queue->totalAudio += audioSecs;
+        }
+        else
+        {
+            fprintf(queue->report, "[%d/%d] %s: FAILED\n", idx + 1, queue->numFiles, queue->wavFiles[idx]);
+            queue->failures++;
+        }
+        
+        fflush(queue->report);
+        
+        pthread_mutex_unlock(&queue->lock);
+    }
+    
+    return (NULL);
+}
+
+// Processes a list of .wav files with config, on up to numJobs threads at
+// once. Returns the number of files that failed.
+int runBatch(const SESSION_CONFIG* config, char** wavFiles, int numFiles, const char* outDir, int numJobs, bool verbose)
+{
+    pthread_t       workers[numJobs];
+    int             numWorkers  = 0;
+    
+    BATCH_QUEUE     queue;
+    
+    struct timespec start;
+    struct timespec end;
+    
+    queue.config        = config;
+    queue.wavFiles      = wavFiles;
+    queue.numFiles      = numFiles;
+    queue.outDir        = outDir;
+    queue.report        = stdout;
+    queue.next          = 0;
+    queue.failures      = 0;
+    queue.totalAudio    = 0.0;
+    
+    pthread_mutex_init(&queue.lock, NULL);
+    
+    // The analysis output would bury the results, so unless asked for it's
+    // thrown away - results go to a copy of the real stdout
+    if (!verbose)
+    {
+        fflush(stdout);
+        
+        FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+        
+        if (report != NULL && freopen("/dev/null", "w", stdout) != NULL)
+        {
+            queue.report = report;
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    for (int i = 0; i < numJobs; i++)
+    {
+        if (pthread_create(&workers[numWorkers], NULL, batchWorker, &queue) != 0)
+        {
+            perror("[!] ERROR: Failed to start worker");
+            continue;
+        }
+        
+        numWorkers++;
+    }
+    
+    // Without any threads, the files are done here instead
+    if (numWorkers == 0)
+    {
+        batchWorker(&queue);
+    }
+    
+    for (int i = 0; i < numWorkers; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    double batchSecs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    
+    fprintf(queue.report, "\n=== %d file(s), %d failed, %d job(s): %.3f s for %.3f s of audio (RTF %.4f) ===\n",
+        numFiles, queue.failures, numJobs, batchSecs, queue.totalAudio,
+        queue.totalAudio > 0.0 ? batchSecs / queue.totalAudio : 0.0);
+    
+    if (queue.report != stdout)
+    {
+        fclose(queue.report);
+    }
+    
+    pthread_mutex_destroy(&queue.lock);
+    
+    return (queue.failures);
+}
+
+int main(int argc, char** argv)
+{
+    int         opt         = 0;
+    int         division    = 4;
+    int         quantNote   = 4;
+    int         numJobs     = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    
+    const char* keyName     = "C major";
+    const char* outDir      = NULL;
+    bool        verbose     = false;
+    bool        validKey    = false;
+    
+    SESSION_CONFIG config;
+    
+    sessionConfigInit(&config);
+    
+    while ((opt = getopt(argc, argv, "t:b:d:k:q:f:H:w:l:p:a:D:j:T:o:vh")) != -1)
+    {
+        switch (opt)
+        {
+            case 't': config.tempo          = atoi(optarg); break;
+            case 'b': config.beatsPerBar    = atoi(optarg); break;
+            case 'd': division              = atoi(optarg); break;
+            case 'k': keyName               = optarg;       break;
+            case 'q': quantNote             = atoi(optarg); break;
+            case 'f': config.fftSize        = atoi(optarg); break;
+            case 'H': config.numHarmonics   = atoi(optarg); break;
+            case 'w': config.windowType     = getWindowType(optarg); break;
+            case 'l': config.overlapPct     = atof(optarg); break;
+            case 'p': config.lowPassOrder   = atoi(optarg); break;
+            case 'a': config.tuning         = atof(optarg); break;
+            case 'D': config.decimation     = atoi(optarg); break;
+            case 'j': numJobs               = atoi(optarg); break;
+            case 'T': config.numThreads     = atoi(optarg); break;
+            case 'o': outDir                = optarg;       break;
+            case 'v': verbose               = true;         break;
+            default:
+                printUsage(argv[0]);
+                return (EXIT_FAILURE);
+        }
+    }
+    
+    for (int i = 0; i < OCTAVE_SIZE * 2; i++)
+    {
+        if (strcmp(keyName, keys[i]) == 0)
+        {
+            validKey = true;
+        }
+    }
+    
+    // Same limits as the GUI
+    if (optind >= argc
+        || config.tempo < 10 || config.tempo > 200
+        || config.beatsPerBar < 2 || config.beatsPerBar > 16
+        || (division != 2 && division != 4 && division != 8)
+        || (quantNote != 1 && quantNote != 2 && quantNote != 4 && quantNote != 8 && quantNote != 16)
+        || getFftSizeIdx(config.fftSize) < 0
+        || config.numHarmonics < MIN_HARMONICS || config.numHarmonics > MAX_HARMONICS
+        || config.windowType < 0
+        || (config.lowPassOrder != 1 && config.lowPassOrder != 2 && config.lowPassOrder != 4 && config.lowPassOrder != 6 && config.lowPassOrder != 8)
+        || (config.overlapPct != 25.0f && config.overlapPct != 50.0f && config.overlapPct != 75.0f && config.overlapPct != 87.5f)
+        || !(config.tuning >= MIN_TUNING && config.tuning <= MAX_TUNING)
+        || (config.decimation != 1 && config.decimation != 2 && config.decimation != MAX_DECIMATION)
+        || numJobs < 1
+        || config.numThreads < 1
+        || !validKey)
+    {
+        printUsage(argv[0]);
+        return (EXIT_FAILURE);
+    }
+    
+    for (int i = optind; i < argc; i++)
+    {
+        int len = strlen(argv[i]);
+        
+        if (len < 5 || strcmp(".wav", &argv[i][len - 4]) != 0 || access(argv[i], R_OK) != 0)
+        {
+            fprintf(stderr, "[!] ERROR: Not a readable .wav file: %s\n", argv[i]);
+            return (EXIT_FAILURE);
+        }
+    }
+    
+    // The HPS looks at numHarmonics harmonics of each note, so decimating
+    // too far lowers the harmonics used
+    int maxHarmonics = getMaxHarmonics((float)SAMPLE_RATE / config.decimation);
+    
+    if (config.numHarmonics > maxHarmonics)
+    {
+        fprintf(stderr, "[!] NOTE: -D %d only keeps up to %.0f Hz, so -H %d is lowered to %d\n",
+                config.decimation, (float)SAMPLE_RATE / config.decimation / 2.0f, config.numHarmonics, maxHarmonics);
+    }
+    
+    config.keySig               = getMIDIKey(keyName);
+    config.noteDiv              = getTimeSigDenom(division == 2 ? "Minims" : (division == 4 ? "Crotchets" : "Quavers"));
+    config.quantisationFactor   = quantNote / 4.0f;  // Matches getQuantVal(), e.g. "1/16 note" = 4.0
+    
+    if (numJobs > argc - optind)
+    {
+        numJobs = argc - optind;
+    }
+    
+    // Built before the batch starts, so all its sessions share the plans -
+    // including the chosen size's, if it isn't one that's built up front
+    planThreads = config.numThreads;
+    
+    fftPlansInit();
+    getFftPlan(config.fftSize, 1);
+    getFftPlan(config.fftSize, FFT_BLOCK_FRAMES);
+    getWindow(config.windowType, config.fftSize);
+    
+    preprocessInit();
+    
+    int failures = runBatch(&config, &argv[optind], argc - optind, outDir, numJobs, verbose);
+    
+    fftPlansCleanup();
+    windowsCleanup();
+    
+    return (failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+#endif
@@ -3,49 +3,344 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <portaudio.h>
+#ifndef HEADLESS
 #include <gtk/gtk.h>
+#endif
 #include <fftw3.h>
 #include "midifile.h"
+#include "onsetsds.h"
+#include "tinywav.h"
+
+// Lock-free single-producer/single-consumer ring buffer of samples. The
+// PortAudio callback is the only writer and the analysis loop the only
+// reader while recording.
+typedef struct
+{
+    float*          data;
+    size_t          size;       // Power of two
+    atomic_size_t   writePos;   // Total samples written - only updated by the producer
+    atomic_size_t   readPos;    // Total samples read - only updated by the consumer
+    atomic_size_t   dropped;    // Samples lost because the buffer was full
+} RING_BUFFER;
+
+// State of a live recording, read by the analysis loop
+typedef struct
+{
+    PaStream*       stream;
+    RING_BUFFER     ring;
+    TinyWav*        tw;         // .wav copy of the recording
+    bool            stopped;    // Stream stopped - nothing more will arrive
+    atomic_bool*    running;    // Cleared when the user stops recording
+} LIVE_CAPTURE;
+
+#define FILTER_BLOCK        8                   // Outputs worked out together
+#define FILTER_BLOCK_COLS   (FILTER_BLOCK + 4)  // x[n-2], x[n-1], the block's inputs,
+                                                // y[n-2], y[n-1]
+#define MAX_FILTER_SECTIONS 5                   // The single pole, then up to 4 Butterworth sections
+#define BUTTERWORTH_MAX_CUTOFF 0.45                 // Highest Butterworth cutoff, as a fraction
+                                                    // of the sample rate (below Nyquist)
+
+// One second order section of the low-pass filter
+typedef struct
+{
+    float           b0, b1, b2, a1, a2;     // Coefficients
+    float           x1, x2, y1, y2;         // Last two inputs and outputs
+    float           weights[FILTER_BLOCK_COLS][FILTER_BLOCK];   // Block form (see filterSectionInit())
+    bool            used[FILTER_BLOCK_COLS];                    // Columns that aren't all zero
+} FILTER_SECTION;
+
+// Low-pass filter - a cascade of sections, run over the stream of samples
+typedef struct
+{
+    FILTER_SECTION  sections[MAX_FILTER_SECTIONS];
+    int             numSections;
+} LOW_PASS_FILTER;
+
+// Decimating FIR filter - low-pass filters the stream and keeps one sample
+// in factor. Only the kept outputs are worked out (polyphase).
+typedef struct
+{
+    int             factor;     // 1 (off) or more
+    int             taps;       // Filter length, padded to a multiple of 8
+    float*          coeffs;     // Oldest sample's tap first
+    float*          history;    // The last taps - 1 inputs, then the chunk
+                                // being decimated
+    int             held;       // Samples in history
+    int             next;       // Position in history of the newest input of
+                                // the next output
+} DECIMATOR;
+
+// Assembles overlapping frames from a stream of samples. Each sample is
+// stored twice, size apart, so the latest frame can always be read as one
+// contiguous run without moving the samples it shares with the last frame.
+typedef struct
+{
+    float*          data;       // 2 * size floats
+    int             size;       // Frame size
+    int             hop;        // Samples between the starts of successive frames
+    int             head;       // Where the next sample goes (0 to size - 1)
+    int             filled;     // Samples held, up to size
+} FRAME_ASSEMBLER;
+
+// Spectral features of one frame, worked out alongside other frames before
+// the (sequential) onset detection and note tracking
+typedef struct
+{
+    OdsPolarBuf*    polar;      // Spectrum in polar form for the onset detector
+    float           peakFreq;   // Estimated frequency of the HPS peak (0 if none)
+    float           peakAmp;    // HPS output at the peak
+} FRAME_FEATURES;
+
+#define MIDI_NOTES          128     // MIDI note numbers (power of two)
+
+// Votes for the pitch of the note being tracked - how many of its frames
+// found each MIDI note, kept up to date so the most common is known at any
+// point. Counts are only valid where stamps matches note, so starting a new
+// note doesn't need them all cleared.
+typedef struct
+{
+    int             counts[MIDI_NOTES];     // Frames that found each note
+    int             firstFrame[MIDI_NOTES]; // Frame each was first found in
+    int             stamps[MIDI_NOTES];     // Note the counts belong to
+    int             note;                   // Current note (see pitchVotesReset())
+    int             frames;                 // Frames voted so far
+    int             best;                   // Most common note so far
+} PITCH_VOTES;
+
+#define NOTE_REST           -1      // Pitch of a rest in the note store
+#define NOTE_STORE_MIN      256     // Notes the store first makes room for
+
+// Notes found, to be translated into MIDI notes - grows as needed (see
+// noteStoreAdd())
+typedef struct
+{
+    int*            pitches;        // MIDI note numbers, or NOTE_REST
+    int*            lengths;        // Frames each lasts
+    int             count;
+    int             capacity;
+} NOTE_STORE;
+
+// MIDI file the notes are written to as they're found (see midiOutputOpen())
+typedef struct
+{
+    MIDI_FILE*      file;           // NULL if not open
+    int             written;        // Notes in the store written so far
+    float           frameTime;      // Secs each frame's worth of a note lasts
+    float           crotchetLen;    // Secs in a crotchet at the session's tempo
+    float           minPerSec;      // Shortest note (secs) after quantisation
+} MIDI_OUTPUT;
+
+// Note tracking state, carried from one frame to the next (see trackNote())
+typedef struct
+{
+    float           prevAmplitude;  // Last recorded amplitude
+    int             noteLen;        // Length of current note (number of iterations the
+                                    // "same note" has been tracked)
+    int             silenceLen;     // Length of silence (no recognisable note being played)
+    int             prevNote;       // MIDI note number of the note being tracked,
+                                    // or NOTE_REST
+    PITCH_VOTES     votes;          // Pitches found over the current note
+} NOTE_TRACKER;
+
+// Settings for a transcription
+typedef struct
+{
+    int             fftSize;            // Frame (and FFT) size
+    int             windowType;         // See getWindow()
+    float           overlapPct;         // Overlap between successive frames (%) - see getHopSize()
+    int             numHarmonics;       // Harmonics the HPS multiplies together
+    int             lowPassOrder;       // 1 (single pole) or 2-8 (Butterworth) - see filterInit()
+    int             decimation;         // Keep one sample in decimation before framing (1, 2 or 4)
+    float           tuning;             // Frequency of A4 (Hz) - see getPitch()
+    int             numThreads;         // Threads the analysis can use for large FFT sizes
+    
+    int             tempo;              // MIDI output
+    tMIDI_KEYSIG    keySig;
+    int             beatsPerBar;
+    int             noteDiv;
+    float           quantisationFactor;
+} SESSION_CONFIG;
+
+// One transcription - of a recording or an upload - with everything it
+// works with, so any number can run at once on different threads
+typedef struct
+{
+    SESSION_CONFIG  config;
+    
+    bool            isRecording;        // Live recording, rather than an upload
+    char            fileOutputLoc[500]; // .mid to write
+    char            wavOutputLoc[500];  // .wav copy of a recording
+    char            wavUploadLoc[500];  // .wav to transcribe
+    
+    atomic_bool     running;            // Cleared to stop a recording
+    
+    float           analysisRate;       // Sample rate the frames are analysed at (after decimation)
+    int             numHarmonics;       // Harmonics the HPS uses - config's, lowered to fit below analysisRate / 2
+    float           processedSecs;      // Length of audio (secs) analysed
+    
+    NOTE_TRACKER    tracker;
+    
+    NOTE_STORE      notes;              // Notes found
+    MIDI_OUTPUT     midi;
+} SESSION;
+
+// HPS output bins that can hold a playable note
+typedef struct
+{
+    int             first;          // First and last output bins
+    int             last;
+    int             spectrumEnd;    // Spectrum bins needed - up to the last bin's top harmonic
+} BIN_RANGE;
+
+// 64-byte aligned block of memory that a session's working buffers are
+// taken from
+typedef struct
+{
+    char*           base;
+    size_t          size;
+    size_t          used;
+} ARENA;
+
+// Working buffers for one analysis session, all allocated from an ARENA
+typedef struct
+{
+    float*          samples;        // Samples just read (before decimation)
+    float*          decimatorMem;   // Storage for the DECIMATOR
+    float*          frameRing;      // Storage for the FRAME_ASSEMBLER
+    float*          stream;         // Filtered upload samples covering a block of frames
+    int             streamLen;      // Size of stream
+    const float*    window;         // Window function (shared - see getWindow())
+    
+    int             blockFrames;    // Frames in a block
+    const float**   frameSrc;       // Filtered samples of each frame in the block
+    float*          inp;            // FFT input for a block of frames
+    fftwf_complex*  outp;           // FFT output for a block of frames
+    float*          polarData;      // Polar spectra for the onset detector
+    FRAME_FEATURES* features;
+    
+    float*          odsData;        // Onset detector state
+    float*          threadScratch;  // HPS working space for each thread
+    int             scratchLen;     // Floats of working space per thread
+    
+    unsigned char*  midiTrack;      // MIDI track data (see midiOutputOpen())
+} ANALYSIS_BUFFERS;
 
 // PortAudio & GTK funcs
 void 	checkError(PaError err);
 void	configureInParams(int inpDevice, PaStreamParameters* i);
-void	activate(GtkApplication* app, gpointer data);
 
-void*	record(void* args); // MAIN FUNCTION. This is where the main data processing loop occurs.
+int 	record(SESSION* session); // MAIN FUNCTION. This is where the main data processing loop occurs.
+void	sessionConfigInit(SESSION_CONFIG* config);
+void	sessionInit(SESSION* session, const SESSION_CONFIG* config);
+
+// Live capture, running alongside the analysis
+int 	captureCallback(const void* input, void* output, unsigned long frameCount,
+                        const PaStreamCallbackTimeInfo* timeInfo, PaStreamCallbackFlags statusFlags,
+                        void* userData);
+int 	captureRead(LIVE_CAPTURE* live, float* samples, int len);
+bool	readFrame(LIVE_CAPTURE* live, FRAME_ASSEMBLER* frames, float* samples, DECIMATOR* dec, LOW_PASS_FILTER* filter);
+int 	readUploadSamples(const TinyWavMap* map, int pos, int len, float* samples, float* output,
+                          DECIMATOR* dec, LOW_PASS_FILTER* filter);
+
+void	ringInit(RING_BUFFER* ring, size_t minCapacity);
+void	ringFree(RING_BUFFER* ring);
+size_t	ringWrite(RING_BUFFER* ring, const float* samples, size_t len);
+size_t	ringRead(RING_BUFFER* ring, float* samples, size_t len);
+
+#ifndef HEADLESS
+void	activate(GtkApplication* app, gpointer data);
 void	toggleRecording(GtkWidget* widget, gpointer data);
+void	processUpload(GtkWidget* widget, gpointer data);
+void*	runGuiSession(void* args);
+void	startGuiSession(void);
+#else
+// Command-line batch mode (built with -DHEADLESS)
+void	printUsage(const char* progName);
+int 	runBatch(const SESSION_CONFIG* config, char** wavFiles, int numFiles, const char* outDir, int numJobs, bool verbose);
+int 	transcribeFile(const SESSION_CONFIG* config, const char* wavFile, const char* outDir, double* wallSecs, double* audioSecs);
+void*	batchWorker(void* args);
+#endif
+
+// FFT plans - built once per FFT size and reused
+int 		getSpectrumStride(int fftSize);
+int 		getFftSizeIdx(int fftSize);
+fftwf_plan	createFftPlan(int fftSize, int howMany);
+void		fftPlansInit(void);
+fftwf_plan	getFftPlan(int fftSize, int howMany);
+void		fftPlansCleanup(void);
 
 // FFT preparation & calculation
-void 	convertToComplexArray(float* samples, fftwf_complex* complex, int length);
 
-void 	saveOverlappedSamples(const float* samples, float* overlapPrev, int len);
-void	overlapWindow(const float* nextSamples, const float* overlapPrev, float* newSamples, int len);
+int 	getHopSize(const SESSION_CONFIG* config);
+void	frameAssemblerInit(FRAME_ASSEMBLER* frames, float* data, int size, int hop);
+void	frameAssemblerPush(FRAME_ASSEMBLER* frames, const float* samples, int len);
+const float*	frameAssemblerFrame(const FRAME_ASSEMBLER* frames);
 
-void	lowPassData(float* input, float* output, int length, int cutoff);
+float	getLowPassAlpha(int cutoff, float sampleRate);
+void	filterSectionInit(FILTER_SECTION* section, double b0, double b1, double b2, double a1, double a2);
+void	filterInit(LOW_PASS_FILTER* filter, int order, int cutoff, int numHarmonics, float sampleRate);
+void	filterReset(LOW_PASS_FILTER* filter, float value);
+void	filterProcess(LOW_PASS_FILTER* filter, const float* input, float* output, int len);
 
-void 	setUpHannWindow(float* windowData, int length);
-void 	setWindow(float* windowData, float* samples, int length);
+int 	getRateFactor(int rate);
+int 	getMaxHarmonics(float rate);
+int 	getDecimatorTaps(int factor);
+int 	getDecimatorMemLen(int factor);
+void	decimatorInit(DECIMATOR* dec, int factor, float* memory);
+void	decimatorReset(DECIMATOR* dec, float value);
+int 	decimatorProcess(DECIMATOR* dec, const float* input, int len, float* output);
+int 	conditionSamples(DECIMATOR* dec, LOW_PASS_FILTER* filter, const float* input, int len, float* output, bool start);
+
+double	besselI0(double x);
+void	setUpWindow(float* windowData, int length, int type);
+const float*	getWindow(int type, int size);
+int 	getWindowType(const char* name);
+void	windowsCleanup(void);
+
+void	preprocessInit(void);
+void	preprocessFrame(const float* input, float* output, const float* window, int length);
+void	preprocessFrames(const float** input, float* output, int count, const float* window, int length);
 
-float 	calcMagnitude(float real, float imaginary);
 
 int 	getArrayLen(int fftLen, int idx);
-void 	harmonicProductSpectrum(fftwf_complex* result, float* outResult, int length);
-void 	downsample(const fftwf_complex* result, float* out, int outLength, int idx);
-void 	hps_getPeak(float* dsResult, int len, bool isOnset);
+BIN_RANGE	getPeakBinRange(int numBins, int harmonics, float binSize);
+void 	harmonicProductSpectrum(fftwf_complex* result, float* outResult, const BIN_RANGE* range, float* scratch,
+                                int harmonics, int threads);
+float	hps_findPeak(const float* dsResult, const BIN_RANGE* range, float binSize, float* peakAmp);
+void	pitchVotesReset(PITCH_VOTES* votes);
+void	pitchVotesAdd(PITCH_VOTES* votes, int midiNote);
+int 	pitchVotesGet(const PITCH_VOTES* votes);
+int 	getTrackedNote(const NOTE_TRACKER* t);
+void	trackNote(SESSION* session, float peakFreq, float peakAmp, bool isOnset);
+void	analyseBlock(SESSION* session, fftwf_plan blockPlan, fftwf_plan framePlan, ANALYSIS_BUFFERS* bufs, int count, OnsetsDS* ods);
+
+// Analysis buffers
+bool	arenaInit(ARENA* arena, size_t size);
+void*	arenaAlloc(ARENA* arena, size_t bytes);
+void	arenaFree(ARENA* arena);
+int 	getHpsScratchLen(int numBins);
+void	carveAnalysisBuffers(ARENA* arena, ANALYSIS_BUFFERS* bufs, const SESSION_CONFIG* config, int blockFrames, int factor);
+bool	allocAnalysisBuffers(ARENA* arena, ANALYSIS_BUFFERS* bufs, const SESSION_CONFIG* config, int blockFrames, int factor);
+float*	getThreadScratch(ANALYSIS_BUFFERS* bufs);
 float   interpolate(float first, float last);
 
-char* 			getPitch(float freq, int* midiNote);
+const char* 	getPitch(float freq, float tuning, int* midiNote);
 tMIDI_KEYSIG 	getMIDIKey(const char* keySig);
 int 			getTimeSigDenom(const char* selected);
 
 // Adding to output buffers
-void 	pitchesAdd(char* pitch, int length, int midiNote);
+bool	noteStoreAdd(NOTE_STORE* store, int pitch, int length);
+void	noteStoreFree(NOTE_STORE* store);
+void 	pitchesAdd(SESSION* session, int pitch, int length);
 
 // MIDI
 int 	getNoteType(float noteDur, float qNoteLen, float minPerSec);
-void 	setMidiNotes();
-void 	outputMidi(float frameTime);
+bool	midiOutputOpen(SESSION* session, float frameTime, void* trackMem, size_t trackMemSize);
+void	midiOutputNotes(SESSION* session, bool final);
+void	midiOutputClose(SESSION* session);
 float	getQuantVal(const char* input);
 
 #endif
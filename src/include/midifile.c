@@ -50,6 +50,7 @@ typedef struct 	{
 				DWORD sz;						/* size of whole iTrack */
 				/* For Writing MIDI Files */
 				DWORD iBlockSize;				/* max size of track */
+				BOOL bInArena;					/* pBase is in the file's arena, not the heap */
 				BYTE iDefaultChannel;			/* use for write only */
 				BYTE last_status;				/* used for running status */
 				
@@ -65,14 +66,33 @@ typedef struct 	{
 				} MIDI_HEADER;
 
 typedef struct {
-				FILE				*pFile;
+		int	iIdx;
+		int	iEndPos;
+		} MIDI_END_POINT;
+
+typedef struct {
+				FILE				*pFile;			/* NULL if written to memory */
 				BOOL				bOpenForWriting;
+				BOOL				bFinished;		/* tracks ended - nothing more can be added */
 				
 				MIDI_HEADER			Header;
 				BYTE *ptr;			/* to whole data block */
 				DWORD file_sz;
 				
 				MIDI_FILE_TRACK		Track[MAX_MIDI_TRACKS];
+				
+				/* For Streaming MIDI Files (see midiFileStreamTrack) */
+				int iStreamTrack;				/* track written out as it goes, or -1 */
+				long iStreamSizePos;			/* file offset of its chunk size */
+				DWORD iStreamSize;				/* bytes of it written so far */
+				
+				/* Caller-supplied memory for track data (see midiFileSetTrackArena) */
+				BYTE *pArena;
+				DWORD iArenaSize;
+				DWORD iArenaUsed;
+				
+				/* Scratch space for midiFileFlushTrack */
+				MIDI_END_POINT EndPoints[MAX_TRACK_POLYPHONY];
 				} _MIDI_FILE;
 
 
@@ -106,6 +126,13 @@ static BOOL _midiValidateTrack(const _MIDI_FILE *pMF, int iTrack)
 		{
 		if (iTrack < 0 || iTrack >= MAX_MIDI_TRACKS)
 			return FALSE;
+		
+		if (pMF->bFinished)
+			return FALSE;
+		
+		/* A streamed file has only the one track */
+		if (pMF->iStreamTrack >= 0 && iTrack != pMF->iStreamTrack)
+			return FALSE;
 		}
 	else	/* open for reading */
 		{
@@ -144,24 +171,150 @@ register long value=n;
 	return(ptr);
 }
 
+static void _midiPutDWORD(BYTE *ptr, DWORD d)
+{
+	ptr[0] = (BYTE)(d>>24);
+	ptr[1] = (BYTE)(d>>16);
+	ptr[2] = (BYTE)(d>>8);
+	ptr[3] = (BYTE)d;
+}
+
+#define MIDI_HEADER_SZ		14			/* 'MThd', size, version, tracks, PPQN */
+#define MIDI_TRACK_HDR_SZ	8			/* 'MTrk', size */
+
+/* Put the file header at ptr */
+static BYTE *_midiPutHeader(const _MIDI_FILE *pMF, BYTE *ptr, int iNumTracks)
+{
+WORD version = (WORD)(iNumTracks==1?pMF->Header.iVersion:1);
+
+	memcpy(ptr, "MThd", 4);
+	_midiPutDWORD(ptr+4, MIDI_HEADER_SZ-8);
+	ptr[8] = (BYTE)(version>>8);
+	ptr[9] = (BYTE)version;
+	ptr[10] = (BYTE)(iNumTracks>>8);
+	ptr[11] = (BYTE)iNumTracks;
+	ptr[12] = (BYTE)(pMF->Header.PPQN>>8);
+	ptr[13] = (BYTE)pMF->Header.PPQN;
+	
+	return ptr+MIDI_HEADER_SZ;
+}
+
+/* Write the file header at the current file position */
+static BOOL _midiWriteHeader(_MIDI_FILE *pMF, int iNumTracks)
+{
+BYTE hdr[MIDI_HEADER_SZ];
+
+	_midiPutHeader(pMF, hdr, iNumTracks);
+	return fwrite(hdr, sizeof(BYTE), sizeof(hdr), pMF->pFile) == sizeof(hdr);
+}
+
+/* Move the streamed track's buffered data to the file, and patch its
+** chunk size. With bProvisionalEnd, an end of track follows the data
+** (and is counted in the size) so the file is complete as it stands -
+** the next write goes over it.
+*/
+static BOOL _midiStreamWrite(_MIDI_FILE *pMF, BOOL bProvisionalEnd)
+{
+const BYTE eot[4] = {0, msgMetaEvent, metaEndSequence, 0};
+MIDI_FILE_TRACK *pTrk = &pMF->Track[pMF->iStreamTrack];
+DWORD sz = (DWORD)(pTrk->ptr - pTrk->pBase);
+BYTE size[4];
+
+	if (fseek(pMF->pFile, pMF->iStreamSizePos+4+pMF->iStreamSize, SEEK_SET))
+		return FALSE;
+	if (fwrite(pTrk->pBase, sizeof(BYTE), sz, pMF->pFile) != sz)
+		return FALSE;
+	
+	pMF->iStreamSize += sz;
+	pTrk->ptr = pTrk->pBase;		/* reuse the buffer */
+	
+	if (bProvisionalEnd)
+		{
+		if (fwrite(eot, sizeof(BYTE), sizeof(eot), pMF->pFile) != sizeof(eot))
+			return FALSE;
+		_midiPutDWORD(size, pMF->iStreamSize+sizeof(eot));
+		}
+	else
+		{
+		_midiPutDWORD(size, pMF->iStreamSize);
+		}
+	
+	if (fseek(pMF->pFile, pMF->iStreamSizePos, SEEK_SET))
+		return FALSE;
+	if (fwrite(size, sizeof(BYTE), sizeof(size), pMF->pFile) != sizeof(size))
+		return FALSE;
+	
+	return fflush(pMF->pFile) == 0;
+}
+
+/* Return a block of sz bytes for a track's data, with the first keep
+** bytes of its current block copied over. Taken from the file's arena
+** while there's room, else the heap.
+*/
+static BYTE *_midiTrackAlloc(_MIDI_FILE *pMF, MIDI_FILE_TRACK *pTrack, DWORD sz, DWORD keep)
+{
+BYTE *ptr;
+BOOL bInArena = FALSE;
+
+	if (pTrack->bInArena && pTrack->pBase+pTrack->iBlockSize == pMF->pArena+pMF->iArenaUsed &&
+		pMF->iArenaUsed-pTrack->iBlockSize+sz <= pMF->iArenaSize)
+		{
+		/* The last block taken from the arena - grow it where it is */
+		pMF->iArenaUsed += sz-pTrack->iBlockSize;
+		return pTrack->pBase;
+		}
+	
+	if (pMF->pArena && pMF->iArenaUsed+sz <= pMF->iArenaSize)
+		{
+		ptr = pMF->pArena+pMF->iArenaUsed;
+		pMF->iArenaUsed += sz;
+		bInArena = TRUE;
+		}
+	else if (!pTrack->bInArena)
+		{
+		return (BYTE *)realloc(pTrack->pBase, sz);
+		}
+	else if (!(ptr = (BYTE *)malloc(sz)))
+		{
+		return NULL;
+		}
+	
+	if (keep)
+		memcpy(ptr, pTrack->pBase, keep);
+	if (!pTrack->bInArena)
+		free((void *)pTrack->pBase);
+	
+	pTrack->bInArena = bInArena;
+	return ptr;
+}
+
 /* Return a ptr to valid block of memory to store a message
 ** of up to sz_reqd bytes 
 */
 static BYTE *_midiGetPtr(_MIDI_FILE *pMF, int iTrack, int sz_reqd)
 {
-const DWORD mem_sz_inc = 8092;	/* arbitary */
+const DWORD mem_sz_min = 8092;	/* arbitary */
 BYTE *ptr;
-int curr_offset;
+DWORD curr_offset, new_sz;
 MIDI_FILE_TRACK *pTrack = &pMF->Track[iTrack];
 
 	ptr = pTrack->ptr;
 	if (ptr == NULL || ptr+sz_reqd > pTrack->pEnd)		/* need more RAM! */
 		{
 		curr_offset = ptr-pTrack->pBase;
-		if ((ptr = (BYTE *)realloc(pTrack->pBase, mem_sz_inc+pTrack->iBlockSize)))
+		
+		/* Double the block each time, so the copying stays linear
+		** in the size of the track */
+		new_sz = pTrack->iBlockSize*2;
+		if (new_sz < mem_sz_min)
+			new_sz = mem_sz_min;
+		if (new_sz < curr_offset+sz_reqd)
+			new_sz = curr_offset+sz_reqd;
+		
+		if ((ptr = _midiTrackAlloc(pMF, pTrack, new_sz, curr_offset)))
 			{
 			pTrack->pBase = ptr;
-			pTrack->iBlockSize += mem_sz_inc;
+			pTrack->iBlockSize = new_sz;
 			pTrack->pEnd = ptr+pTrack->iBlockSize;
 			/* Move new ptr to continue data entry: */
 			pTrack->ptr = ptr+curr_offset;
@@ -247,10 +400,40 @@ int length = ppqn;
 /*
 ** midiFile* Functions
 */
+static void _midiInitForWriting(_MIDI_FILE *pMF)
+{
+int i;
+
+	pMF->bOpenForWriting = TRUE;
+	pMF->bFinished = FALSE;
+	pMF->ptr = NULL;
+	pMF->Header.PPQN = MIDI_PPQN_DEFAULT;
+	pMF->Header.iVersion = MIDI_VERSION_DEFAULT;
+	pMF->iStreamTrack = -1;
+	pMF->iStreamSizePos = 0;
+	pMF->iStreamSize = 0;
+	pMF->pArena = NULL;
+	pMF->iArenaSize = 0;
+	pMF->iArenaUsed = 0;
+	
+	for(i=0;i<MAX_MIDI_TRACKS;++i)
+		{
+		pMF->Track[i].pos = 0;
+		pMF->Track[i].ptr = NULL;
+		pMF->Track[i].pBase = NULL;
+		pMF->Track[i].pEnd = NULL;
+		pMF->Track[i].iBlockSize = 0;
+		pMF->Track[i].bInArena = FALSE;
+		pMF->Track[i].dt = 0;
+		pMF->Track[i].iDefaultChannel = (BYTE)(i & 0xf);
+		
+		memset(pMF->Track[i].LastNote, '\0', sizeof(pMF->Track[i].LastNote));
+		}
+}
+
 MIDI_FILE  *midiFileCreate(const char *pFilename, BOOL bOverwriteIfExists)
 {
 _MIDI_FILE *pMF = (_MIDI_FILE *)malloc(sizeof(_MIDI_FILE));
-int i;
 
 	if (!pMF)							return NULL;
 	
@@ -272,22 +455,20 @@ int i;
 		return NULL;
 		}
 	
-	pMF->bOpenForWriting = TRUE;
-	pMF->Header.PPQN = MIDI_PPQN_DEFAULT;
-	pMF->Header.iVersion = MIDI_VERSION_DEFAULT;
+	_midiInitForWriting(pMF);
 	
-	for(i=0;i<MAX_MIDI_TRACKS;++i)
-		{
-		pMF->Track[i].pos = 0;
-		pMF->Track[i].ptr = NULL;
-		pMF->Track[i].pBase = NULL;
-		pMF->Track[i].pEnd = NULL;
-		pMF->Track[i].iBlockSize = 0;
-		pMF->Track[i].dt = 0;
-		pMF->Track[i].iDefaultChannel = (BYTE)(i & 0xf);
-		
-		memset(pMF->Track[i].LastNote, '\0', sizeof(pMF->Track[i].LastNote));
-		}
+	return (MIDI_FILE *)pMF;
+}
+
+/* A file built up in memory, with no file on disk - see midiFileSerialise */
+MIDI_FILE  *midiFileCreateInMemory(void)
+{
+_MIDI_FILE *pMF = (_MIDI_FILE *)malloc(sizeof(_MIDI_FILE));
+
+	if (!pMF)							return NULL;
+	
+	pMF->pFile = NULL;
+	_midiInitForWriting(pMF);
 	
 	return (MIDI_FILE *)pMF;
 }
@@ -415,6 +596,7 @@ long size;
 						}
 						   
 					pMF->bOpenForWriting = FALSE;
+					pMF->iStreamTrack = -1;
 					pMF->pFile = NULL;
 					bValidFile = TRUE;
 					}
@@ -433,17 +615,38 @@ long size;
 	return (MIDI_FILE *)pMF;
 }
 
-typedef struct {
-		int	iIdx;
-		int	iEndPos;
-		} MIDI_END_POINT;
+/* Track data is taken from the iSize bytes at pArena, rather than the
+** heap, for as long as it fits (after which it moves to the heap). The
+** memory must last until the file is closed - it isn't freed.
+*/
+BOOL	midiFileSetTrackArena(MIDI_FILE *_pMF, void *pArena, DWORD iSize)
+{
+	_VAR_CAST;
+	if (!IsFilePtrValid(pMF))				return FALSE;
+	if (!pMF->bOpenForWriting)				return FALSE;
+	
+	pMF->pArena = (BYTE *)pArena;
+	pMF->iArenaSize = pArena ? iSize : 0;
+	pMF->iArenaUsed = 0;
+	
+	return TRUE;
+}
 
-static int qs_cmp_pEndPoints(const void *e1, const void *e2)
+/* Sort end points, smallest first. There are only ever a few, so an
+** insertion sort will do (and keeps equal ones in order).
+*/
+static void _midiSortEndPoints(MIDI_END_POINT *pEndPoints, int num)
 {
-MIDI_END_POINT *p1 = (MIDI_END_POINT *)e1;
-MIDI_END_POINT *p2 = (MIDI_END_POINT *)e2;
+MIDI_END_POINT tmp;
+int i, j;
 
-	return p1->iEndPos-p2->iEndPos;
+	for(i=1;i<num;++i)
+		{
+		tmp = pEndPoints[i];
+		for(j=i;j>0 && pEndPoints[j-1].iEndPos > tmp.iEndPos;--j)
+			pEndPoints[j] = pEndPoints[j-1];
+		pEndPoints[j] = tmp;
+		}
 }
 
 BOOL	midiFileFlushTrack(MIDI_FILE *_pMF, int iTrack, BOOL bFlushToEnd, DWORD dwEndTimePos)
@@ -461,7 +664,7 @@ int num, i, mx_pts;
 	/*
 	** Flush all 
 	*/
-	pEndPoints = (MIDI_END_POINT *)malloc(sz * sizeof(MIDI_END_POINT));
+	pEndPoints = pMF->EndPoints;
 	mx_pts = 0;
 	for(i=0;i<sz;++i)
 		if (pMF->Track[iTrack].LastNote[i].valid)
@@ -482,7 +685,7 @@ int num, i, mx_pts;
 	if (mx_pts)
 		{
 		/* Sort, smallest first, and add the note off msgs */
-		qsort(pEndPoints, mx_pts, sizeof(MIDI_END_POINT), qs_cmp_pEndPoints);
+		_midiSortEndPoints(pEndPoints, mx_pts);
 		
 		i = 0;
 		while ((dwEndTimePos >= (DWORD)pEndPoints[i].iEndPos || bFlushToEnd) && i<mx_pts)
@@ -508,7 +711,6 @@ int num, i, mx_pts;
 			}
 		}
 	
-	free((void *)pEndPoints);
 	/*
 	** Re-calc current position
 	*/
@@ -536,85 +738,205 @@ int p1, p2;
 }
 
 
+/* Write iTrack out to the file as it goes, rather than all at once on
+** closing, so the file has everything up to the last midiFileStreamFlush()
+** even if it's never closed. The file then holds only iTrack - the
+** header is written now, and patched on closing.
+*/
+BOOL	midiFileStreamTrack(MIDI_FILE *_pMF, int iTrack)
+{
+const BYTE mtrk[8] = {'M', 'T', 'r', 'k', 0,0,0,0};
+int i;
+
+	_VAR_CAST;
+	if (!IsFilePtrValid(pMF))				return FALSE;
+	if (!pMF->bOpenForWriting)				return FALSE;
+	if (!pMF->pFile)						return FALSE;
+	if (pMF->iStreamTrack >= 0)				return FALSE;
+	if (!IsTrackValid(iTrack))				return FALSE;
+	
+	for(i=0;i<MAX_MIDI_TRACKS;++i)
+		if (i != iTrack && pMF->Track[i].ptr)
+			return FALSE;
+	
+	/* Make sure the track counts as used, even if nothing's added */
+	if (!_midiGetPtr(pMF, iTrack, DT_DEF))
+		return FALSE;
+	
+	rewind(pMF->pFile);
+	if (!_midiWriteHeader(pMF, 1))
+		return FALSE;
+	
+	pMF->iStreamSizePos = ftell(pMF->pFile)+4;
+	if (fwrite(mtrk, sizeof(BYTE), sizeof(mtrk), pMF->pFile) != sizeof(mtrk))
+		return FALSE;
+	
+	pMF->iStreamTrack = iTrack;
+	pMF->iStreamSize = 0;
+	
+	return _midiStreamWrite(pMF, TRUE);
+}
+
+/* Write out what's been added to the streamed track since the last flush */
+BOOL	midiFileStreamFlush(MIDI_FILE *_pMF)
+{
+	_VAR_CAST;
+	if (!IsFilePtrValid(pMF))				return FALSE;
+	if (pMF->iStreamTrack < 0)				return FALSE;
+	
+	return _midiStreamWrite(pMF, TRUE);
+}
+
+/* End every track in use, flushing any notes still playing */
+static void _midiFinishTracks(_MIDI_FILE *pMF)
+{
+int i;
+
+	if (pMF->bFinished)
+		return;
+	
+	for(i=0;i<MAX_MIDI_TRACKS;++i)
+		{
+		if (pMF->Track[i].ptr)
+			{
+			midiSongAddEndSequence(pMF, i);
+			midiFileFlushTrack(pMF, i, TRUE, 0);
+			}
+		}
+	
+	pMF->bFinished = TRUE;
+}
+
+/* Put the whole file - header and tracks - into pBuf, if iBufSize is
+** enough, and return its size either way. Pass a NULL pBuf to find the
+** size needed. The tracks are ended the first time, so nothing more can
+** be added after. Not for a file whose track is streamed.
+*/
+DWORD	midiFileSerialise(MIDI_FILE *_pMF, BYTE *pBuf, DWORD iBufSize)
+{
+BYTE *ptr;
+DWORD sz, dwData;
+int iNumTracks = 0;
+int i;
+
+	_VAR_CAST;
+	if (!IsFilePtrValid(pMF))				return 0;
+	if (!pMF->bOpenForWriting)				return 0;
+	if (pMF->iStreamTrack >= 0)				return 0;
+	
+	_midiFinishTracks(pMF);
+	
+	sz = MIDI_HEADER_SZ;
+	for(i=0;i<MAX_MIDI_TRACKS;++i)
+		if (pMF->Track[i].ptr)
+			{
+			sz += MIDI_TRACK_HDR_SZ+(DWORD)(pMF->Track[i].ptr - pMF->Track[i].pBase);
+			iNumTracks++;
+			}
+	
+	if (!pBuf || iBufSize < sz)
+		return sz;
+	
+	ptr = _midiPutHeader(pMF, pBuf, iNumTracks);
+	for(i=0;i<MAX_MIDI_TRACKS;++i)
+		if (pMF->Track[i].ptr)
+			{
+			dwData = (DWORD)(pMF->Track[i].ptr - pMF->Track[i].pBase);
+			
+			memcpy(ptr, "MTrk", 4);
+			_midiPutDWORD(ptr+4, dwData);
+			memcpy(ptr+MIDI_TRACK_HDR_SZ, pMF->Track[i].pBase, dwData);
+			ptr += MIDI_TRACK_HDR_SZ+dwData;
+			}
+	
+	return sz;
+}
+
+/* As midiFileSerialise, into a block allocated to fit (free() it after).
+** The size goes in *pSize.
+*/
+BYTE   *midiFileSerialiseAlloc(MIDI_FILE *pMF, DWORD *pSize)
+{
+BYTE *pBuf;
+DWORD sz;
+
+	if (!(sz = midiFileSerialise(pMF, NULL, 0)))
+		return NULL;
+	if (!(pBuf = (BYTE *)malloc(sz)))
+		return NULL;
+	
+	midiFileSerialise(pMF, pBuf, sz);
+	if (pSize)
+		*pSize = sz;
+	
+	return pBuf;
+}
+
 BOOL	midiFileClose(MIDI_FILE *_pMF)
 {
+BOOL bSuccess = TRUE;
+
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))			return FALSE;
 	
-	if (pMF->bOpenForWriting)	
+	if (pMF->bOpenForWriting && pMF->iStreamTrack >= 0)
+		{
+		int i = pMF->iStreamTrack;
+		
+		midiSongAddEndSequence(pMF, i);
+		midiFileFlushTrack(pMF, i, TRUE, 0);
+		
+		/* Rest of the track, with the real end of track, then the header
+		** again in case the PPQN or version have changed since */
+		if (!_midiStreamWrite(pMF, FALSE))
+			bSuccess = FALSE;
+		rewind(pMF->pFile);
+		if (!_midiWriteHeader(pMF, 1))
+			bSuccess = FALSE;
+		
+		if (!pMF->Track[i].bInArena)
+			free((void *)pMF->Track[i].pBase);
+		}
+	else if (pMF->bOpenForWriting)	
 		{
-		WORD iNumTracks = 0;
-		WORD wTest = 256;
-		BOOL bSwap = FALSE;
 		int i;
-
-		/* Intel processor style-endians need byte swap :( */
-		if (*((BYTE *)&wTest) == 0)
-			bSwap = TRUE;
-
-		/* Flush our buffers  */
-		for(i=0;i<MAX_MIDI_TRACKS;++i)
+		
+		/* The whole file in one block, and one write */
+		if (pMF->pFile)
 			{
-			if (pMF->Track[i].ptr)
+			BYTE *pBuf;
+			DWORD sz;
+			
+			if ((pBuf = midiFileSerialiseAlloc(pMF, &sz)))
+				{
+				if (fwrite(pBuf, sizeof(BYTE), sz, pMF->pFile) != sz)
+					bSuccess = FALSE;
+				free((void *)pBuf);
+				}
+			else
 				{
-				midiSongAddEndSequence(pMF, i);
-				midiFileFlushTrack(pMF, i, TRUE, 0);
-				iNumTracks++;
+				bSuccess = FALSE;
 				}
 			}
-		/* 
-		** Header 
-		*/
-		{
-		const BYTE mthd[4] = {'M', 'T', 'h', 'd'};
-		DWORD dwData;
-		WORD wData;
-		WORD version, PPQN;
-
-			fwrite(mthd, sizeof(BYTE), 4, pMF->pFile);
-			dwData = 6;
-			if (bSwap)	dwData = SWAP_DWORD(dwData);
-			fwrite(&dwData, sizeof(DWORD), 1, pMF->pFile);
-
-			wData = (WORD)(iNumTracks==1?pMF->Header.iVersion:1);
-			if (bSwap)	version = SWAP_WORD(wData); else version = (WORD)wData;
-			if (bSwap)	iNumTracks = SWAP_WORD(iNumTracks);
-			wData = pMF->Header.PPQN;
-			if (bSwap)	PPQN = SWAP_WORD(wData); else PPQN = wData;
-			fwrite(&version, sizeof(WORD), 1, pMF->pFile);
-			fwrite(&iNumTracks, sizeof(WORD), 1, pMF->pFile);
-			fwrite(&PPQN, sizeof(WORD), 1, pMF->pFile);
-		}
-		/*
-		** Track data
-		*/
+		
+		/* Free memory */
 		for(i=0;i<MAX_MIDI_TRACKS;++i)
-			if (pMF->Track[i].ptr)
-				{
-				const BYTE mtrk[4] = {'M', 'T', 'r', 'k'};
-				DWORD sz, dwData;
-
-				/* Write track header */
-				fwrite(&mtrk, sizeof(BYTE), 4, pMF->pFile);
-
-				/* Write data size */
-				sz = dwData = (int)(pMF->Track[i].ptr - pMF->Track[i].pBase);
-				if (bSwap)	sz = SWAP_DWORD(sz);
-				fwrite(&sz, sizeof(DWORD), 1, pMF->pFile);
-
-				/* Write data */
-				fwrite(pMF->Track[i].pBase, sizeof(BYTE), dwData, pMF->pFile);
-				
-				/* Free memory */
+			if (pMF->Track[i].ptr && !pMF->Track[i].bInArena)
 				free((void *)pMF->Track[i].pBase);
-				}
-
 		}
 
 	if (pMF->pFile)
-		return fclose(pMF->pFile)?FALSE:TRUE;
+		{
+		if (fclose(pMF->pFile))
+			bSuccess = FALSE;
+		}
+	else if (!pMF->bOpenForWriting)
+		{
+		free((void *)pMF->ptr);			/* file read in by midiFileOpen */
+		}
+	
 	free((void *)pMF);
-	return TRUE;
+	return bSuccess;
 }
 
 
@@ -623,7 +945,7 @@ BOOL	midiFileClose(MIDI_FILE *_pMF)
 */
 BOOL	midiSongAddSMPTEOffset(MIDI_FILE *_pMF, int iTrack, int iHours, int iMins, int iSecs, int iFrames, int iFFrames)
 {
-static BYTE tmp[] = {msgMetaEvent, metaSMPTEOffset, 0x05, 0,0,0,0,0};
+BYTE tmp[] = {msgMetaEvent, metaSMPTEOffset, 0x05, 0,0,0,0,0};
 
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))				return FALSE;
@@ -649,7 +971,7 @@ BOOL	midiSongAddSimpleTimeSig(MIDI_FILE *_pMF, int iTrack, int iNom, int iDenom)
 
 BOOL	midiSongAddTimeSig(MIDI_FILE *_pMF, int iTrack, int iNom, int iDenom, int iClockInMetroTick, int iNotated32nds)
 {
-static BYTE tmp[] = {msgMetaEvent, metaTimeSig, 0x04, 0,0,0,0};
+BYTE tmp[] = {msgMetaEvent, metaTimeSig, 0x04, 0,0,0,0};
 
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))				return FALSE;
@@ -664,7 +986,7 @@ static BYTE tmp[] = {msgMetaEvent, metaTimeSig, 0x04, 0,0,0,0};
 
 BOOL	midiSongAddKeySig(MIDI_FILE *_pMF, int iTrack, tMIDI_KEYSIG iKey)
 {
-static BYTE tmp[] = {msgMetaEvent, metaKeySig, 0x02, 0, 0};
+BYTE tmp[] = {msgMetaEvent, metaKeySig, 0x02, 0, 0};
 
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))				return FALSE;
@@ -677,7 +999,7 @@ static BYTE tmp[] = {msgMetaEvent, metaKeySig, 0x02, 0, 0};
 
 BOOL	midiSongAddTempo(MIDI_FILE *_pMF, int iTrack, int iTempo)
 {
-static BYTE tmp[] = {msgMetaEvent, metaSetTempo, 0x03, 0,0,0};
+BYTE tmp[] = {msgMetaEvent, metaSetTempo, 0x03, 0,0,0};
 int us;	/* micro-seconds per qn */
 
 	_VAR_CAST;
@@ -693,7 +1015,7 @@ int us;	/* micro-seconds per qn */
 
 BOOL	midiSongAddMIDIPort(MIDI_FILE *_pMF, int iTrack, int iPort)
 {
-static BYTE tmp[] = {msgMetaEvent, metaMIDIPort, 1, 0};
+BYTE tmp[] = {msgMetaEvent, metaMIDIPort, 1, 0};
 
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))				return FALSE;
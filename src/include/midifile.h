@@ -156,8 +156,10 @@ typedef struct {
 ** midiFile* Prototypes
 */
 MIDI_FILE  *midiFileCreate(const char *pFilename, BOOL bOverwriteIfExists);
+MIDI_FILE  *midiFileCreateInMemory(void);
 int			midiFileSetTracksDefaultChannel(MIDI_FILE *pMF, int iTrack, int iChannel);
 int			midiFileGetTracksDefaultChannel(const MIDI_FILE *pMF, int iTrack);
+BOOL		midiFileSetTrackArena(MIDI_FILE *pMF, void *pArena, DWORD iSize);
 BOOL		midiFileFlushTrack(MIDI_FILE *pMF, int iTrack, BOOL bFlushToEnd, DWORD dwEndTimePos);
 BOOL		midiFileSyncTracks(MIDI_FILE *pMF, int iTrack1, int iTrack2);
 int			midiFileSetPPQN(MIDI_FILE *pMF, int PPQN);
@@ -165,6 +167,10 @@ int			midiFileGetPPQN(const MIDI_FILE *pMF);
 int			midiFileSetVersion(MIDI_FILE *pMF, int iVersion);
 int			midiFileGetVersion(const MIDI_FILE *pMF);
 MIDI_FILE  *midiFileOpen(const char *pFilename);
+BOOL		midiFileStreamTrack(MIDI_FILE *pMF, int iTrack);
+BOOL		midiFileStreamFlush(MIDI_FILE *pMF);
+DWORD		midiFileSerialise(MIDI_FILE *pMF, BYTE *pBuf, DWORD iBufSize);
+BYTE	   *midiFileSerialiseAlloc(MIDI_FILE *pMF, DWORD *pSize);
 BOOL		midiFileClose(MIDI_FILE *pMF);
 
 /*
@@ -23,6 +23,10 @@
 
 #define ODS_DEBUG_POST_CSV 0
 
+// FFT size from which the cartesian-to-polar conversion in onsetsds_loadframe()
+// is split across OpenMP threads (when built with -fopenmp)
+#define ODS_PARALLEL_MIN_SIZE 8192
+
 float onsetsds_phase_rewrap(float phase);
 float onsetsds_phase_rewrap(float phase){
 	return (phase>MINUSPI && phase<PI) ? phase : phase + TWOPI * (1.f + floorf((MINUSPI - phase) * INV_TWOPI));
@@ -172,6 +176,21 @@ bool onsetsds_process(OnsetsDS* ods, float* fftbuf){
 	return ods->detected;
 }
 
+bool onsetsds_process_polar(OnsetsDS* ods, OdsPolarBuf* polar){
+	OdsPolarBuf* own = ods->curr;
+	
+	// Work on the caller's frame in place of the internal one
+	ods->curr = polar;
+	
+	onsetsds_whiten(ods);
+	onsetsds_odf(ods);
+	onsetsds_detect(ods);
+	
+	ods->curr = own;
+	
+	return ods->detected;
+}
+
 
 void onsetsds_setrelax(OnsetsDS* ods, float time, size_t hopsize){
 	ods->relaxtime = time;
@@ -181,6 +200,10 @@ void onsetsds_setrelax(OnsetsDS* ods, float time, size_t hopsize){
 
 
 void onsetsds_loadframe(OnsetsDS* ods, float* fftbuf){
+	onsetsds_loadframe_into(ods, fftbuf, ods->curr);
+}
+
+void onsetsds_loadframe_into(const OnsetsDS* ods, float* fftbuf, OdsPolarBuf* polar){
 	
 	float *pos, *pos2, imag, real;
 	int i;
@@ -188,53 +211,55 @@ void onsetsds_loadframe(OnsetsDS* ods, float* fftbuf){
 	switch(ods->fftformat){
 		case ODS_FFT_SC3_POLAR:
 			// The format is the same! dc, nyq, mag[1], phase[1], ...
-			memcpy(ods->curr, fftbuf, ods->fftsize * sizeof(float));
+			memcpy(polar, fftbuf, ods->fftsize * sizeof(float));
 			break;
 			
 		case ODS_FFT_SC3_COMPLEX:
 		
-			ods->curr->dc  = fftbuf[0];
-			ods->curr->nyq = fftbuf[1];
+			polar->dc  = fftbuf[0];
+			polar->nyq = fftbuf[1];
 			
 			// Then convert cartesian to polar:
 			pos = fftbuf + 2;
 			for(i=0; i< (ods->numbins << 1); i += 2){
 				real = pos[i];
 				imag = pos[i+1]; // Plus 1 rather than increment; seems to avoid LSU reject on my PPC
-				ods->curr->bin[i].mag   = hypotf(imag, real);
-				ods->curr->bin[i].phase = atan2f(imag, real);
+				polar->bin[i].mag   = hypotf(imag, real);
+				polar->bin[i].phase = atan2f(imag, real);
 			}
 			break;
 			
 		case ODS_FFT_FFTW3_HC:
 			
-			ods->curr->dc  = fftbuf[0];
-			ods->curr->nyq = fftbuf[ods->fftsize>>1];
+			polar->dc  = fftbuf[0];
+			polar->nyq = fftbuf[ods->fftsize>>1];
 			
 			// Then convert cartesian to polar:
 			// (Starting positions: real and imag for bin 1)
 			pos  = fftbuf + 1;
 			pos2 = fftbuf + ods->fftsize - 1;
+			#pragma omp parallel for private(real, imag) if(ods->fftsize >= ODS_PARALLEL_MIN_SIZE)
 			for(i=0; i<ods->numbins; i++){
-				real = *(pos++);
-				imag = *(pos2--);
-				ods->curr->bin[i].mag   = hypotf(imag, real);
-				ods->curr->bin[i].phase = atan2f(imag, real);
+				real = pos[i];
+				imag = pos2[-i];
+				polar->bin[i].mag   = hypotf(imag, real);
+				polar->bin[i].phase = atan2f(imag, real);
 			}
 			break;
 			
 		case ODS_FFT_FFTW3_R2C:
 		
-			ods->curr->dc  = fftbuf[0];
-			ods->curr->nyq = fftbuf[ods->fftsize];
+			polar->dc  = fftbuf[0];
+			polar->nyq = fftbuf[ods->fftsize];
 			
 			// Then convert cartesian to polar:
 			pos = fftbuf + 2;
+			#pragma omp parallel for private(real, imag) if(ods->fftsize >= ODS_PARALLEL_MIN_SIZE)
 			for(i=0; i<ods->numbins; i++){
-				real = *(pos++);
-				imag = *(pos++);
-				ods->curr->bin[i].mag   = hypotf(imag, real);
-				ods->curr->bin[i].phase = atan2f(imag, real);
+				real = pos[i << 1];
+				imag = pos[(i << 1) + 1];
+				polar->bin[i].mag   = hypotf(imag, real);
+				polar->bin[i].phase = atan2f(imag, real);
 			}
 			break;
 			
@@ -244,13 +269,13 @@ void onsetsds_loadframe(OnsetsDS* ods, float* fftbuf){
 	// Not well tested yet.
 	if(ods->logmags){
 		for(i=0; i<ods->numbins; i++){
-			ods->curr->bin[i].mag = 
-				(log(ods_max(ods->curr->bin[i].mag, ODS_LOG_LOWER_LIMIT)) - ODS_LOGOF_LOG_LOWER_LIMIT) * ODS_ABSINVOF_LOGOF_LOG_LOWER_LIMIT;
+			polar->bin[i].mag = 
+				(log(ods_max(polar->bin[i].mag, ODS_LOG_LOWER_LIMIT)) - ODS_LOGOF_LOG_LOWER_LIMIT) * ODS_ABSINVOF_LOGOF_LOG_LOWER_LIMIT;
 		}
-		ods->curr->dc = 
-			(log(ods_max(ods_abs(ods->curr->dc ), ODS_LOG_LOWER_LIMIT)) - ODS_LOGOF_LOG_LOWER_LIMIT) * ODS_ABSINVOF_LOGOF_LOG_LOWER_LIMIT;
-		ods->curr->nyq = 
-			(log(ods_max(ods_abs(ods->curr->nyq), ODS_LOG_LOWER_LIMIT)) - ODS_LOGOF_LOG_LOWER_LIMIT) * ODS_ABSINVOF_LOGOF_LOG_LOWER_LIMIT;
+		polar->dc = 
+			(log(ods_max(ods_abs(polar->dc ), ODS_LOG_LOWER_LIMIT)) - ODS_LOGOF_LOG_LOWER_LIMIT) * ODS_ABSINVOF_LOGOF_LOG_LOWER_LIMIT;
+		polar->nyq = 
+			(log(ods_max(ods_abs(polar->nyq), ODS_LOG_LOWER_LIMIT)) - ODS_LOGOF_LOG_LOWER_LIMIT) * ODS_ABSINVOF_LOGOF_LOG_LOWER_LIMIT;
 	}
 	
 }
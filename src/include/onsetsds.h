@@ -205,6 +205,15 @@ void onsetsds_init(OnsetsDS* ods, float* odsdata, int fftformat,
 */
 bool   onsetsds_process(OnsetsDS* ods, float* fftbuf);
 
+/**
+* Process a frame that has already been converted to polar form by
+* onsetsds_loadframe_into(), e.g. on another thread. Otherwise the same as
+* onsetsds_process(). Frames must still be passed in order.
+*
+* The frame is whitened in place, so its contents are changed.
+*/
+bool   onsetsds_process_polar(OnsetsDS* ods, OdsPolarBuf* polar);
+
 //@}
 
 
@@ -240,6 +249,14 @@ void onsetsds_setrelax(OnsetsDS* ods, float time, size_t hopsize);
 */
 void onsetsds_loadframe(OnsetsDS* ods, float* fftbuf);
 
+/**
+* Convert a frame of FFT data to polar form in a separate buffer (of fftsize
+* floats), without touching the rest of the OnsetsDS state. As it only reads
+* the settings in the struct, this can be run for several frames at once -
+* then pass each frame in order to onsetsds_process_polar().
+*/
+void onsetsds_loadframe_into(const OnsetsDS* ods, float* fftbuf, OdsPolarBuf* polar);
+
 /**
 * Apply adaptive whitening to the FFT data in the OnsetsDS struct.
 *
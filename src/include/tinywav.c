@@ -19,6 +19,10 @@
 #include <malloc.h> // for alloca
 #else
 #include <alloca.h>
+#include <fcntl.h> // for open
+#include <unistd.h> // for close
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
 #endif
 #include "tinywav.h"
 
@@ -389,3 +393,117 @@ void tinywav_close_write(TinyWav *tw) {
 bool tinywav_isOpen(TinyWav *tw) {
   return (tw->f != NULL);
 }
+
+#if !_WIN32
+int tinywav_map_open(TinyWavMap *twm, const char *path) {
+  
+  if (twm == NULL || path == NULL) {
+    return -1;
+  }
+  
+  twm->base = NULL;
+  twm->mapSize = 0;
+  
+  // Parse the header as normal, which leaves the file positioned at the first sample
+  TinyWav tw;
+  if (tinywav_open_read(&tw, path, TW_INTERLEAVED) != 0) {
+    return -1;
+  }
+  long dataOffset = ftell(tw.f);
+  twm->h = tw.h;
+  twm->numChannels = tw.numChannels;
+  twm->sampFmt = tw.sampFmt;
+  tinywav_close_read(&tw);
+  
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || dataOffset < 0 || st.st_size <= dataOffset || twm->numChannels <= 0) {
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  
+  void *base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping stays valid
+  if (base == MAP_FAILED) {
+    perror("[tinywav] Failed to map file for reading");
+    return -1;
+  }
+  
+  // Samples are read in order
+  madvise(base, (size_t) st.st_size, MADV_SEQUENTIAL);
+  
+  twm->base = base;
+  twm->mapSize = (size_t) st.st_size;
+  twm->data = (const char *) base + dataOffset;
+  
+  // Only count frames that are both declared in the header and actually in the file.
+  // Frames are sized by the sample format samples are read as, not BlockAlign, so a
+  // file tagged with a format it does not hold can never be read past its end.
+  size_t frameSize = (size_t) twm->numChannels * twm->sampFmt;
+  size_t framesInFile = (twm->mapSize - (size_t) dataOffset) / frameSize;
+  size_t framesInHeader = twm->h.Subchunk2Size / frameSize;
+  twm->numFrames = (int32_t) (framesInFile < framesInHeader ? framesInFile : framesInHeader);
+  
+  return 0;
+}
+
+const float *tinywav_map_frames_f(const TinyWavMap *twm, int32_t frame) {
+  
+  if (twm == NULL || twm->base == NULL || twm->sampFmt != TW_FLOAT32
+      || ((uintptr_t) twm->data % sizeof(float)) != 0 || frame < 0 || frame > twm->numFrames) {
+    return NULL;
+  }
+  
+  return (const float *) twm->data + (size_t) frame * twm->numChannels;
+}
+
+int tinywav_map_read_f(const TinyWavMap *twm, int32_t frame, float *out, int len, int channel) {
+  
+  if (twm == NULL || twm->base == NULL || out == NULL || len < 0 || frame < 0
+      || channel < 0 || channel >= twm->numChannels) {
+    return -1;
+  }
+  
+  if (frame >= twm->numFrames) {
+    return 0;
+  }
+  if (len > twm->numFrames - frame) {
+    len = twm->numFrames - frame;
+  }
+  
+  size_t frameSize = (size_t) twm->numChannels * twm->sampFmt;
+  const char *pos = (const char *) twm->data + (size_t) frame * frameSize + channel * twm->sampFmt;
+  
+  switch (twm->sampFmt) {
+    case TW_INT16: {
+      for (int i = 0; i < len; i++, pos += frameSize) {
+        int16_t sample;
+        memcpy(&sample, pos, sizeof(int16_t)); // may not be aligned
+        out[i] = (float) sample / INT16_MAX;
+      }
+      return len;
+    }
+    case TW_FLOAT32: {
+      if (twm->numChannels == 1) {
+        memcpy(out, pos, len * sizeof(float));
+        return len;
+      }
+      for (int i = 0; i < len; i++, pos += frameSize) {
+        memcpy(&out[i], pos, sizeof(float));
+      }
+      return len;
+    }
+    default: return 0;
+  }
+}
+
+void tinywav_map_close(TinyWavMap *twm) {
+  if (twm == NULL || twm->base == NULL) {
+    return;
+  }
+  
+  munmap(twm->base, twm->mapSize);
+  twm->base = NULL;
+  twm->data = NULL;
+}
+#endif
@@ -66,6 +66,17 @@ typedef struct TinyWav {
   TinyWavSampleFormat sampFmt;
 } TinyWav;
 
+/** A wav file mapped into memory for reading, so samples can be used where they lie. */
+typedef struct TinyWavMap {
+  void *base;       ///< start of the mapping (the whole file)
+  size_t mapSize;   ///< size of the mapping in bytes
+  const void *data; ///< first sample of the 'data' subchunk
+  TinyWavHeader h;
+  int16_t numChannels;
+  int32_t numFrames; ///< number of samples per channel actually present in the file
+  TinyWavSampleFormat sampFmt;
+} TinyWavMap;
+
 /**
  * Open a file for writing.
  *
@@ -124,6 +135,46 @@ void tinywav_close_write(TinyWav *tw);
 
 /** Returns true if the Tinywav struct is available to write or write. False otherwise. */
 bool tinywav_isOpen(TinyWav *tw);
+
+#if !_WIN32
+/**
+ * Map a wav file into memory for reading. The header is parsed as in tinywav_open_read().
+ *
+ * @param twm   The TinyWavMap structure to prepare.
+ * @param path  The path of the wav file to read.
+ *
+ * @return  The error code. Zero if no error.
+ */
+int tinywav_map_open(TinyWavMap *twm, const char *path);
+
+/**
+ * Get the samples of a mapped file in place, without copying them.
+ *
+ * @param twm    The mapped file.
+ * @param frame  The first frame (sample per channel) wanted.
+ *
+ * @return  A pointer to the interleaved float32 samples starting at that frame, or NULL if the
+ *          file does not hold (suitably aligned) float32 samples - use tinywav_map_read_f() then.
+ */
+const float *tinywav_map_frames_f(const TinyWavMap *twm, int32_t frame);
+
+/**
+ * Read one channel of a mapped file into a float buffer, converting int16 samples as
+ * tinywav_read_f() does.
+ *
+ * @param twm      The mapped file.
+ * @param frame    The first frame (sample per channel) to read.
+ * @param out      The buffer to read to.
+ * @param len      The number of frames to read.
+ * @param channel  The channel to read.
+ *
+ * @return The number of frames read.
+ */
+int tinywav_map_read_f(const TinyWavMap *twm, int32_t frame, float *out, int len, int channel);
+
+/** Unmap the file. The TinyWavMap struct is now invalid. */
+void tinywav_map_close(TinyWavMap *twm);
+#endif
   
 #ifdef __cplusplus
 }